@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// On-disk catalog of the directories of many archives, used in place through mmap.
+// Layout: header, archives table, subentry records in archive order, record ids sorted
+// by (name, index, type, face, archive), metadata words, then a table of paths.
+// All values are little-endian and naturally aligned, so no deserialization is needed.
+
+#define CATALOG_VERSION 1
+
+struct CatalogHeader {
+	char magic[8]; // "M3CATLG"
+	uint32_t version;
+	uint32_t archiveCount;
+	uint32_t recordCount;
+	uint32_t metadataCount;
+	uint64_t archivesOffset;
+	uint64_t recordsOffset;
+	uint64_t sortedOffset;
+	uint64_t metadataOffset;
+	uint64_t stringsOffset;
+	uint64_t stringsSize;
+};
+
+struct CatalogArchive {
+	uint64_t fileSize;
+	uint32_t pathOffset;
+	uint32_t pathSize;
+	uint32_t firstRecord;
+	uint32_t recordCount;
+	uint32_t headerSize;
+	uint32_t encoded;
+};
+
+enum CatalogFlags : uint32_t {
+	kCatalogHasData = 1 // offset and size describe a blob, not metadata values.
+};
+
+struct CatalogRecord {
+	uint64_t hash; // of the blob, 0 if no data.
+	uint32_t archive;
+	uint32_t index;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t firstMetadata;
+	uint16_t metadataCount;
+	uint8_t type;
+	uint8_t face;
+	char name[4]; // entry name, or the default name of its archive, zero padded.
+	uint32_t flags;
+
+	std::string entryName() const {
+		return std::string(name, strnlen(name, sizeof(name)));
+	}
+};
+
+static_assert(sizeof(CatalogHeader) == 72, "Catalog header layout changed.");
+static_assert(sizeof(CatalogArchive) == 32, "Catalog archive layout changed.");
+static_assert(sizeof(CatalogRecord) == 40, "Catalog record layout changed.");
+
+const char kCatalogMagic[8] = "M3CATLG";
+
+// Order used by the sorted record ids.
+inline bool catalogRecordLess(const CatalogRecord& a, const CatalogRecord& b){
+	const int nameOrder = strncmp(a.name, b.name, sizeof(a.name));
+	if(nameOrder != 0){
+		return nameOrder < 0;
+	}
+	if(a.index != b.index){
+		return a.index < b.index;
+	}
+	if(a.type != b.type){
+		return a.type < b.type;
+	}
+	if(a.face != b.face){
+		return a.face < b.face;
+	}
+	return a.archive < b.archive;
+}
+
+// Read-only view of a catalog file, safe to share between threads.
+struct ArchiveCatalog {
+	int fd{-1};
+	const unsigned char* mapping{nullptr};
+	size_t mappingSize{0};
+
+	ArchiveCatalog() = default;
+	ArchiveCatalog(const ArchiveCatalog&) = delete;
+	ArchiveCatalog& operator=(const ArchiveCatalog&) = delete;
+
+	~ArchiveCatalog(){
+		if(mapping){
+			munmap((void*)mapping, mappingSize);
+		}
+		if(fd >= 0){
+			close(fd);
+		}
+	}
+
+	bool open(const char* path){
+		fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		struct stat fileStat;
+		if(fd < 0 || fstat(fd, &fileStat) != 0 || size_t(fileStat.st_size) < sizeof(CatalogHeader)){
+			return false;
+		}
+		mappingSize = fileStat.st_size;
+		void* ptr = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+		if(ptr == MAP_FAILED){
+			return false;
+		}
+		mapping = (const unsigned char*)ptr;
+
+		// Check that all tables are inside the file.
+		const CatalogHeader& head = header();
+		if(memcmp(head.magic, kCatalogMagic, sizeof(kCatalogMagic)) != 0 || head.version != CATALOG_VERSION){
+			return false;
+		}
+		return fits(head.archivesOffset, uint64_t(head.archiveCount) * sizeof(CatalogArchive))
+			&& fits(head.recordsOffset, uint64_t(head.recordCount) * sizeof(CatalogRecord))
+			&& fits(head.sortedOffset, uint64_t(head.recordCount) * sizeof(uint32_t))
+			&& fits(head.metadataOffset, uint64_t(head.metadataCount) * sizeof(uint32_t))
+			&& fits(head.stringsOffset, head.stringsSize);
+	}
+
+	bool fits(uint64_t offset, uint64_t size) const {
+		return offset <= mappingSize && size <= mappingSize - offset;
+	}
+
+	const CatalogHeader& header() const {
+		return *(const CatalogHeader*)mapping;
+	}
+
+	uint32_t archiveCount() const {
+		return header().archiveCount;
+	}
+
+	const CatalogArchive& archive(uint32_t id) const {
+		return ((const CatalogArchive*)(mapping + header().archivesOffset))[id];
+	}
+
+	std::string archivePath(uint32_t id) const {
+		const CatalogArchive& item = archive(id);
+		return std::string((const char*)mapping + header().stringsOffset + item.pathOffset, item.pathSize);
+	}
+
+	uint32_t recordCount() const {
+		return header().recordCount;
+	}
+
+	const CatalogRecord* records() const {
+		return (const CatalogRecord*)(mapping + header().recordsOffset);
+	}
+
+	const uint32_t* metadata(const CatalogRecord& record) const {
+		return (const uint32_t*)(mapping + header().metadataOffset) + record.firstMetadata;
+	}
+
+	// Ids of the records of an entry, in all archives.
+	std::pair<const uint32_t*, const uint32_t*> findEntry(const std::string& name, uint32_t index) const {
+		const uint32_t* sorted = (const uint32_t*)(mapping + header().sortedOffset);
+		const CatalogRecord* items = records();
+		CatalogRecord key;
+		memset(&key, 0, sizeof(key));
+		memcpy(key.name, name.data(), std::min(name.size(), sizeof(key.name)));
+		key.index = index;
+		const uint32_t* first = std::lower_bound(sorted, sorted + recordCount(), key, [items](uint32_t id, const CatalogRecord& value){
+			return catalogRecordLess(items[id], value);
+		});
+		const uint32_t* last = first;
+		while(last != sorted + recordCount() && strncmp(items[*last].name, key.name, sizeof(key.name)) == 0 && items[*last].index == index){
+			++last;
+		}
+		return { first, last };
+	}
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "M3Archive.hpp"
+
+// Read-only access to an archive: the directory is parsed once and indexed, blobs are then
+// returned either from a mapping of the file or read on demand. Once opened, a reader can be
+// used from multiple threads at the same time.
+
+// Bytes of a blob, pointing in the mapped file or in its own storage.
+struct BlobSpan {
+	const unsigned char* data{nullptr};
+	size_t size{0};
+	std::vector<unsigned char> storage; // used when the file is not mapped.
+
+	BlobSpan() = default;
+	BlobSpan(BlobSpan&&) = default;
+	BlobSpan& operator=(BlobSpan&&) = default;
+	BlobSpan(const BlobSpan&) = delete;
+	BlobSpan& operator=(const BlobSpan&) = delete;
+
+	const unsigned char* begin() const {
+		return data;
+	}
+
+	const unsigned char* end() const {
+		return data + size;
+	}
+};
+
+struct SubEntryKey {
+	char name[4];
+	uint32_t index;
+	unsigned char type;
+	unsigned char face;
+
+	SubEntryKey(const std::string& entryName, uint32_t entryIndex, ResourceType resourceType, unsigned char resourceFace) : index(entryIndex), type(resourceType), face(resourceFace) {
+		memset(name, 0, sizeof(name));
+		memcpy(name, entryName.data(), std::min(entryName.size(), sizeof(name)));
+	}
+
+	bool operator==(const SubEntryKey& other) const {
+		return memcmp(name, other.name, sizeof(name)) == 0 && index == other.index && type == other.type && face == other.face;
+	}
+};
+
+struct SubEntryKeyHash {
+	size_t operator()(const SubEntryKey& key) const {
+		unsigned char packed[10];
+		memcpy(packed, key.name, 4);
+		memcpy(packed + 4, &key.index, 4);
+		packed[8] = key.type;
+		packed[9] = key.face;
+		return size_t(hashData(packed, sizeof(packed)));
+	}
+};
+
+struct ArchiveReader {
+	static const uint32_t kNotFound = 0xFFFFFFFF;
+
+	FlatDirectory directory;
+	std::string defaultEntryName; // for archives without entry names.
+	std::unordered_map<SubEntryKey, uint32_t, SubEntryKeyHash> subEntries;
+	FILE* file{nullptr};
+	const unsigned char* mapping{nullptr};
+	uint64_t fileSize{0};
+
+	ArchiveReader() = default;
+	ArchiveReader(const ArchiveReader&) = delete;
+	ArchiveReader& operator=(const ArchiveReader&) = delete;
+
+	~ArchiveReader(){
+		if(mapping){
+			munmap((void*)mapping, fileSize);
+		}
+		if(file){
+			fclose(file);
+		}
+	}
+
+	// If mapFile is false or mapping fails, blobs are read when requested.
+	bool open(const std::string& path, bool expectNames, bool mapFile = true){
+		file = fopen(path.c_str(), "rb");
+		struct stat fileStat;
+		if(!file || fstat(fileno(file), &fileStat) != 0){
+			return false;
+		}
+		fileSize = fileStat.st_size;
+		readFlatDirectory(file, directory, expectNames);
+
+		// Same default name as the packer: start of the file name.
+		const size_t nameStart = path.find_last_of('/') == std::string::npos ? 0 : path.find_last_of('/') + 1;
+		const size_t extensionStart = path.find_last_of('.');
+		const size_t nameEnd = (extensionStart == std::string::npos || extensionStart < nameStart) ? path.size() : extensionStart;
+		defaultEntryName = path.substr(nameStart, std::min(size_t(4), nameEnd - nameStart));
+
+		subEntries.reserve(directory.subEntryCount());
+		for(uint32_t subEntry = 0; subEntry < directory.subEntryCount(); ++subEntry){
+			const uint32_t entry = directory.entryIds[subEntry];
+			const SubEntryKey key(entryName(entry), directory.indices[entry], directory.type(subEntry), directory.faces[subEntry]);
+			subEntries.emplace(key, subEntry);
+		}
+
+		if(mapFile && fileSize != 0){
+			void* ptr = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fileno(file), 0);
+			mapping = ptr == MAP_FAILED ? nullptr : (const unsigned char*)ptr;
+		}
+		return true;
+	}
+
+	bool isMapped() const {
+		return mapping != nullptr;
+	}
+
+	std::string entryName(uint32_t entry) const {
+		return directory.names.empty() ? defaultEntryName : directory.name(entry);
+	}
+
+	// Id of the subentry in the directory, or kNotFound.
+	uint32_t find(const std::string& name, uint32_t index, ResourceType type, unsigned char face) const {
+		auto subEntry = subEntries.find(SubEntryKey(name, index, type, face));
+		return subEntry == subEntries.end() ? kNotFound : subEntry->second;
+	}
+
+	// Fails for subentries without data or with a range outside of the file.
+	bool read(uint32_t subEntry, BlobSpan& blob) const {
+		blob.data = nullptr;
+		blob.size = 0;
+		const uint32_t offset = directory.offsets[subEntry];
+		const uint32_t size = directory.sizes[subEntry];
+		if(!storesData(directory.type(subEntry)) || uint64_t(offset) + size > fileSize){
+			return false;
+		}
+		if(mapping){
+			blob.data = mapping + offset;
+			blob.size = size;
+			return true;
+		}
+		blob.storage.resize(size);
+		size_t transferred = 0;
+		while(transferred < size){
+			const ssize_t res = pread(fileno(file), blob.storage.data() + transferred, size - transferred, off_t(offset + transferred));
+			if(res < 0 && errno == EINTR){
+				continue;
+			}
+			if(res <= 0){
+				return false;
+			}
+			transferred += res;
+		}
+		blob.data = blob.storage.data();
+		blob.size = size;
+		return true;
+	}
+};
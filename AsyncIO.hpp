@@ -0,0 +1,378 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Batched positional reads and writes, submitted through io_uring when the kernel supports it,
+// or executed by a shared pool of threads calling pread/pwrite otherwise.
+
+struct IORequest {
+	int fd;
+	unsigned char* buffer;
+	size_t size;
+	uint64_t offset;
+	bool write;
+	size_t transferred{0};
+	int error{0}; // errno value.
+
+	bool success() const {
+		return error == 0 && transferred == size;
+	}
+};
+
+struct IOSettings {
+	bool useRing{true};
+	unsigned int queueDepth{32};
+	unsigned int fallbackThreads{4};
+};
+
+// Perform a single request synchronously, retrying on short transfers.
+inline void executeRequest(IORequest& request){
+	while(request.transferred < request.size){
+		unsigned char* ptr = request.buffer + request.transferred;
+		const size_t remaining = request.size - request.transferred;
+		const off_t offset = off_t(request.offset + request.transferred);
+		const ssize_t res = request.write ? pwrite(request.fd, ptr, remaining, offset) : pread(request.fd, ptr, remaining, offset);
+		if(res < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			request.error = errno;
+			return;
+		}
+		if(res == 0){
+			// End of file.
+			request.error = EIO;
+			return;
+		}
+		request.transferred += res;
+	}
+}
+
+// Pool of threads shared by all callers, each batch waits for its own requests only.
+struct IOThreadPool {
+
+	struct Batch {
+		std::vector<IORequest>* requests;
+		size_t remaining;
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+
+	struct Task {
+		Batch* batch;
+		size_t id;
+	};
+
+	std::deque<Task> tasks;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable available;
+	bool stopping{false};
+
+	explicit IOThreadPool(unsigned int threadCount){
+		for(unsigned int i = 0; i < std::max(threadCount, 1u); ++i){
+			threads.emplace_back([this](){ work(); });
+		}
+	}
+
+	~IOThreadPool(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		available.notify_all();
+		for(std::thread& thread : threads){
+			thread.join();
+		}
+	}
+
+	void work(){
+		while(true){
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				available.wait(lock, [this](){ return stopping || !tasks.empty(); });
+				if(tasks.empty()){
+					return;
+				}
+				task = tasks.front();
+				tasks.pop_front();
+			}
+			executeRequest((*task.batch->requests)[task.id]);
+
+			std::lock_guard<std::mutex> lock(task.batch->mutex);
+			if(--task.batch->remaining == 0){
+				task.batch->done.notify_all();
+			}
+		}
+	}
+
+	void submit(std::vector<IORequest>& requests){
+		if(requests.empty()){
+			return;
+		}
+		Batch batch;
+		batch.requests = &requests;
+		batch.remaining = requests.size();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for(size_t i = 0; i < requests.size(); ++i){
+				tasks.push_back({ &batch, i });
+			}
+		}
+		available.notify_all();
+
+		std::unique_lock<std::mutex> lock(batch.mutex);
+		batch.done.wait(lock, [&batch](){ return batch.remaining == 0; });
+	}
+
+	static IOThreadPool& shared(unsigned int threadCount){
+		static IOThreadPool pool(threadCount);
+		return pool;
+	}
+};
+
+// Minimal io_uring wrapper, using raw system calls so that liburing is not required.
+struct IORing {
+	int fd{-1};
+	unsigned int entries{0};
+
+	unsigned int* sqHead{nullptr};
+	unsigned int* sqTail{nullptr};
+	unsigned int* sqMask{nullptr};
+	unsigned int* sqArray{nullptr};
+	io_uring_sqe* sqes{nullptr};
+
+	unsigned int* cqHead{nullptr};
+	unsigned int* cqTail{nullptr};
+	unsigned int* cqMask{nullptr};
+	io_uring_cqe* cqes{nullptr};
+
+	void* sqRing{MAP_FAILED};
+	void* cqRing{MAP_FAILED};
+	size_t sqRingSize{0};
+	size_t cqRingSize{0};
+	size_t sqesSize{0};
+
+	~IORing(){
+		if(sqes && (void*)sqes != MAP_FAILED){
+			munmap(sqes, sqesSize);
+		}
+		if(cqRing != MAP_FAILED && cqRing != sqRing){
+			munmap(cqRing, cqRingSize);
+		}
+		if(sqRing != MAP_FAILED){
+			munmap(sqRing, sqRingSize);
+		}
+		if(fd >= 0){
+			close(fd);
+		}
+	}
+
+	bool init(unsigned int depth){
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		fd = int(syscall(__NR_io_uring_setup, depth, &params));
+		if(fd < 0){
+			return false;
+		}
+		entries = params.sq_entries;
+
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if(singleMap){
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		}
+
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if(sqRing == MAP_FAILED){
+			return false;
+		}
+		cqRing = singleMap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if(cqRing == MAP_FAILED){
+			return false;
+		}
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if((void*)sqes == MAP_FAILED){
+			return false;
+		}
+
+		unsigned char* sqBase = (unsigned char*)sqRing;
+		sqHead  = (unsigned int*)(sqBase + params.sq_off.head);
+		sqTail  = (unsigned int*)(sqBase + params.sq_off.tail);
+		sqMask  = (unsigned int*)(sqBase + params.sq_off.ring_mask);
+		sqArray = (unsigned int*)(sqBase + params.sq_off.array);
+
+		unsigned char* cqBase = (unsigned char*)cqRing;
+		cqHead = (unsigned int*)(cqBase + params.cq_off.head);
+		cqTail = (unsigned int*)(cqBase + params.cq_off.tail);
+		cqMask = (unsigned int*)(cqBase + params.cq_off.ring_mask);
+		cqes   = (io_uring_cqe*)(cqBase + params.cq_off.cqes);
+		return true;
+	}
+
+	// Process available completions, short transfers are queued again.
+	void reap(std::vector<IORequest>& requests, std::deque<size_t>& toSubmit, unsigned int& inFlight, size_t& remaining){
+		unsigned int head = *cqHead;
+		const unsigned int cqTailValue = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		for(; head != cqTailValue; ++head){
+			const io_uring_cqe& cqe = cqes[head & *cqMask];
+			IORequest& request = requests[cqe.user_data];
+			--inFlight;
+			if(cqe.res < 0){
+				request.error = -cqe.res;
+			} else if(cqe.res == 0){
+				request.error = EIO;
+			} else {
+				request.transferred += cqe.res;
+				if(request.transferred < request.size){
+					toSubmit.push_back(cqe.user_data);
+					continue;
+				}
+			}
+			--remaining;
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	// After a failure of the ring, withdraw the entries the kernel has not consumed yet, and wait for
+	// the others as they still reference the buffers and iovecs.
+	void drain(std::vector<IORequest>& requests, std::deque<size_t>& toSubmit, unsigned int& inFlight, size_t& remaining){
+		const unsigned int head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+		inFlight -= *sqTail - head;
+		__atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+		while(true){
+			reap(requests, toSubmit, inFlight, remaining);
+			if(inFlight == 0){
+				return;
+			}
+			if(syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR){
+				// Completions are still posted without waiting in the kernel.
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}
+
+	// Keep up to 'entries' requests in flight until all are complete. Short transfers are resubmitted.
+	// Returns false if the ring itself failed, no request is in flight anymore and the ones not completed keep their progress.
+	bool submit(std::vector<IORequest>& requests){
+		std::vector<iovec> iovecs(requests.size());
+		std::deque<size_t> toSubmit;
+		for(size_t i = 0; i < requests.size(); ++i){
+			if(requests[i].size != 0){
+				toSubmit.push_back(i);
+			}
+		}
+		size_t remaining = toSubmit.size();
+		unsigned int inFlight = 0;
+
+		while(remaining != 0){
+			// Fill submission queue.
+			unsigned int tail = *sqTail;
+			while(!toSubmit.empty() && inFlight < entries){
+				const size_t id = toSubmit.front();
+				toSubmit.pop_front();
+				IORequest& request = requests[id];
+				iovecs[id].iov_base = request.buffer + request.transferred;
+				iovecs[id].iov_len = request.size - request.transferred;
+
+				const unsigned int index = tail & *sqMask;
+				io_uring_sqe& sqe = sqes[index];
+				memset(&sqe, 0, sizeof(sqe));
+				sqe.opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+				sqe.fd = request.fd;
+				sqe.addr = (uint64_t)&iovecs[id];
+				sqe.len = 1;
+				sqe.off = request.offset + request.transferred;
+				sqe.user_data = id;
+				sqArray[index] = index;
+				++tail;
+				++inFlight;
+			}
+			__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+			// Entries not consumed by a previous call are still pending.
+			const unsigned int pending = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+			int res = int(syscall(__NR_io_uring_enter, fd, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+			if(res < 0 && errno != EINTR){
+				drain(requests, toSubmit, inFlight, remaining);
+				return false;
+			}
+			reap(requests, toSubmit, inFlight, remaining);
+		}
+		return true;
+	}
+};
+
+// Each thread gets its own ring, all threads share the fallback pool.
+struct AsyncIO {
+	std::unique_ptr<IORing> ring;
+	IOThreadPool* pool{nullptr};
+	unsigned int fallbackThreads;
+
+	explicit AsyncIO(const IOSettings& settings) : fallbackThreads(settings.fallbackThreads) {
+		if(settings.useRing){
+			ring.reset(new IORing());
+			if(!ring->init(std::max(settings.queueDepth, 1u))){
+				ring.reset();
+			}
+		}
+		if(!ring){
+			pool = &IOThreadPool::shared(fallbackThreads);
+		}
+	}
+
+	bool usesRing() const {
+		return ring != nullptr;
+	}
+
+	// Blocks until all requests are complete, returns true if all succeeded.
+	bool submit(std::vector<IORequest>& requests){
+		if(ring && !ring->submit(requests)){
+			// The ring is unusable, finish the batch and the following ones with the pool.
+			ring.reset();
+			pool = &IOThreadPool::shared(fallbackThreads);
+		}
+		if(pool){
+			std::vector<IORequest> pending;
+			std::vector<size_t> ids;
+			for(size_t i = 0; i < requests.size(); ++i){
+				if(requests[i].error == 0 && requests[i].transferred < requests[i].size){
+					pending.push_back(requests[i]);
+					ids.push_back(i);
+				}
+			}
+			pool->submit(pending);
+			for(size_t i = 0; i < ids.size(); ++i){
+				requests[ids[i]] = pending[i];
+			}
+		}
+		bool success = true;
+		for(const IORequest& request : requests){
+			success = success && request.success();
+		}
+		return success;
+	}
+
+	static AsyncIO& forThread(const IOSettings& settings){
+		thread_local AsyncIO io(settings);
+		return io;
+	}
+};
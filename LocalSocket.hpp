@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// Transport of the daemon mode, over a Unix domain socket. Messages are lines of text, requests are
+// flat JSON objects whose values are strings, numbers, booleans or arrays of them.
+
+// Fields of a message, all values kept as strings.
+struct LocalMessage {
+	std::map<std::string, std::vector<std::string>> values;
+
+	static void skipSpaces(const std::string& str, size_t& pos){
+		while(pos < str.size() && (str[pos] == ' ' || str[pos] == '\t' || str[pos] == '\r' || str[pos] == '\n')){
+			++pos;
+		}
+	}
+
+	static bool expect(const std::string& str, size_t& pos, char c){
+		skipSpaces(str, pos);
+		if(pos >= str.size() || str[pos] != c){
+			return false;
+		}
+		++pos;
+		return true;
+	}
+
+	static void appendUTF8(std::string& str, uint32_t code){
+		if(code < 0x80){
+			str += char(code);
+		} else if(code < 0x800){
+			str += char(0xC0 | (code >> 6));
+			str += char(0x80 | (code & 0x3F));
+		} else {
+			str += char(0xE0 | (code >> 12));
+			str += char(0x80 | ((code >> 6) & 0x3F));
+			str += char(0x80 | (code & 0x3F));
+		}
+	}
+
+	static bool parseString(const std::string& str, size_t& pos, std::string& value){
+		if(!expect(str, pos, '"')){
+			return false;
+		}
+		while(pos < str.size() && str[pos] != '"'){
+			if(str[pos] != '\\'){
+				value += str[pos++];
+				continue;
+			}
+			if(++pos >= str.size()){
+				return false;
+			}
+			const char c = str[pos++];
+			switch(c){
+				case 'b': value += '\b'; break;
+				case 'f': value += '\f'; break;
+				case 'n': value += '\n'; break;
+				case 'r': value += '\r'; break;
+				case 't': value += '\t'; break;
+				case 'u': {
+					const std::string digits = str.substr(pos, 4);
+					char* end = nullptr;
+					const unsigned long code = strtoul(digits.c_str(), &end, 16);
+					if(digits.size() != 4 || end != digits.c_str() + 4){
+						return false;
+					}
+					appendUTF8(value, uint32_t(code));
+					pos += 4;
+					break;
+				}
+				default: value += c; break;
+			}
+		}
+		return expect(str, pos, '"');
+	}
+
+	// String, or the literal text of a number, boolean or null.
+	static bool parseScalar(const std::string& str, size_t& pos, std::string& value){
+		skipSpaces(str, pos);
+		if(pos < str.size() && str[pos] == '"'){
+			return parseString(str, pos, value);
+		}
+		while(pos < str.size() && (isalnum((unsigned char)str[pos]) || str[pos] == '.' || str[pos] == '-' || str[pos] == '+')){
+			value += str[pos++];
+		}
+		return !value.empty();
+	}
+
+	bool parse(const std::string& str){
+		size_t pos = 0;
+		if(!expect(str, pos, '{')){
+			return false;
+		}
+		skipSpaces(str, pos);
+		if(pos < str.size() && str[pos] == '}'){
+			return true;
+		}
+		while(true){
+			std::string key;
+			if(!parseString(str, pos, key) || !expect(str, pos, ':')){
+				return false;
+			}
+			std::vector<std::string>& items = values[key];
+			items.clear();
+			skipSpaces(str, pos);
+			if(pos < str.size() && str[pos] == '['){
+				++pos;
+				skipSpaces(str, pos);
+				if(pos < str.size() && str[pos] == ']'){
+					++pos;
+				} else {
+					do {
+						items.emplace_back();
+						if(!parseScalar(str, pos, items.back())){
+							return false;
+						}
+					} while(expect(str, pos, ','));
+					if(!expect(str, pos, ']')){
+						return false;
+					}
+				}
+			} else {
+				items.emplace_back();
+				if(!parseScalar(str, pos, items.back())){
+					return false;
+				}
+			}
+			if(expect(str, pos, ',')){
+				continue;
+			}
+			return expect(str, pos, '}');
+		}
+	}
+
+	std::string value(const std::string& key, const std::string& fallback = "") const {
+		auto item = values.find(key);
+		return (item == values.end() || item->second.empty()) ? fallback : item->second[0];
+	}
+
+	std::vector<std::string> list(const std::string& key) const {
+		auto item = values.find(key);
+		return item == values.end() ? std::vector<std::string>() : item->second;
+	}
+};
+
+inline bool makeLocalAddress(const std::string& path, sockaddr_un& address){
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(address.sun_path)){
+		return false;
+	}
+	memcpy(address.sun_path, path.c_str(), path.size());
+	return true;
+}
+
+inline int connectLocal(const std::string& path){
+	sockaddr_un address;
+	if(!makeLocalAddress(path, address)){
+		return -1;
+	}
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0){
+		return -1;
+	}
+	if(connect(fd, (const sockaddr*)&address, sizeof(address)) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Replaces a stale socket left by a previous daemon, but neither another kind of file
+// nor the socket of a running daemon. Returns -1 on failure.
+inline int listenLocal(const std::string& path){
+	sockaddr_un address;
+	if(!makeLocalAddress(path, address)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	struct stat fileStat;
+	if(lstat(path.c_str(), &fileStat) == 0){
+		if(!S_ISSOCK(fileStat.st_mode)){
+			errno = EEXIST;
+			return -1;
+		}
+		const int liveFd = connectLocal(path);
+		if(liveFd >= 0){
+			close(liveFd);
+			errno = EADDRINUSE;
+			return -1;
+		}
+		unlink(path.c_str());
+	}
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0){
+		return -1;
+	}
+	if(bind(fd, (const sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 16) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Reads and writes on the socket fail after the given delay without progress.
+inline bool setSocketTimeouts(int fd, int milliseconds){
+	timeval timeout;
+	timeout.tv_sec = milliseconds / 1000;
+	timeout.tv_usec = (milliseconds % 1000) * 1000;
+	return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0
+		&& setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+// Read up to the next line break, excluded. Bytes after it are kept in pending for the next call.
+inline bool readLine(int fd, std::string& pending, std::string& line, size_t maxSize = 1 << 20){
+	while(true){
+		const size_t end = pending.find('\n');
+		if(end != std::string::npos){
+			line = pending.substr(0, end);
+			pending.erase(0, end + 1);
+			return true;
+		}
+		if(pending.size() > maxSize){
+			return false;
+		}
+		char buffer[4096];
+		const ssize_t size = read(fd, buffer, sizeof(buffer));
+		if(size <= 0){
+			// A last line without line break, unless the read failed or timed out.
+			if(size < 0 || pending.empty()){
+				return false;
+			}
+			line.swap(pending);
+			pending.clear();
+			return true;
+		}
+		pending.append(buffer, size);
+	}
+}
+
+// Never raises SIGPIPE if the peer is gone.
+inline bool writeAll(int fd, const std::string& str){
+	size_t written = 0;
+	while(written < str.size()){
+		const ssize_t size = send(fd, str.data() + written, str.size() - written, MSG_NOSIGNAL);
+		if(size <= 0){
+			return false;
+		}
+		written += size;
+	}
+	return true;
+}
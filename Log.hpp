@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+// Leveled logging. Messages below the current level are not even formatted. Each thread formats
+// its lines in its own buffer, complete lines are then queued at once and written by a background
+// thread, so that workers never wait on the terminal and lines of parallel tasks never interleave.
+// Lines can also be written as JSON objects, one per line.
+
+enum LogLevel {
+	kLogError,
+	kLogWarning,
+	kLogInfo,
+	kLogVerbose
+};
+
+const char* const logLevelNames[] = { "error", "warning", "info", "verbose" };
+
+struct LogMessage {
+	LogLevel level;
+	std::string text; // can span multiple lines, a final line break is optional.
+};
+
+// Messages kept in order, to be logged together later.
+struct LogBuffer {
+	std::vector<LogMessage> messages;
+};
+
+struct Logger {
+	LogLevel level{kLogInfo};
+	bool json{false};
+	FILE* output{stdout};
+
+	std::chrono::steady_clock::time_point origin{std::chrono::steady_clock::now()};
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::condition_variable drained;
+	std::string pending;
+	bool writing{false};
+	bool stopping{false};
+	std::thread sink;
+
+	Logger(){
+		sink = std::thread([this](){ drain(); });
+	}
+
+	~Logger(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		sink.join();
+	}
+
+	bool enabled(LogLevel messageLevel) const {
+		return messageLevel <= level;
+	}
+
+	static unsigned int threadIndex(){
+		static std::atomic<unsigned int> threadCount{0};
+		thread_local unsigned int index = threadCount++;
+		return index;
+	}
+
+	static void appendJSONString(std::string& str, const std::string& value){
+		str += '"';
+		for(char c : value){
+			if(c == '"' || c == '\\'){
+				str += '\\';
+				str += c;
+			} else if(c == '\t'){
+				str += "\\t";
+			} else if((unsigned char)c >= 0x20){
+				str += c;
+			}
+		}
+		str += '"';
+	}
+
+	// Format a message as complete lines.
+	void format(const LogMessage& message, std::string& str) const {
+		if(!json){
+			str += message.text;
+			if(message.text.empty() || message.text.back() != '\n'){
+				str += '\n';
+			}
+			return;
+		}
+		const double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count();
+		const std::string thread = std::to_string(threadIndex());
+		std::istringstream lines(message.text);
+		std::string line;
+		while(std::getline(lines, line)){
+			str += "{\"time\":" + std::to_string(time) + ",\"level\":\"" + logLevelNames[message.level] + "\",\"thread\":" + thread + ",\"message\":";
+			appendJSONString(str, line);
+			str += "}\n";
+		}
+	}
+
+	void write(LogLevel messageLevel, const std::string& text){
+		if(!enabled(messageLevel)){
+			return;
+		}
+		std::string str;
+		format({ messageLevel, text }, str);
+		queue(str);
+	}
+
+	// Messages of the buffer are written together.
+	void write(const LogBuffer& buffer){
+		std::string str;
+		for(const LogMessage& message : buffer.messages){
+			if(enabled(message.level)){
+				format(message, str);
+			}
+		}
+		queue(str);
+	}
+
+	void queue(const std::string& str){
+		if(str.empty()){
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending += str;
+		}
+		wakeUp.notify_one();
+	}
+
+	// Wait until all queued messages are written.
+	void flush(){
+		std::unique_lock<std::mutex> lock(mutex);
+		drained.wait(lock, [this](){ return pending.empty() && !writing; });
+	}
+
+	// Write the following messages to another file, once the queued ones are written. Returns the previous file.
+	FILE* redirect(FILE* newOutput){
+		std::unique_lock<std::mutex> lock(mutex);
+		drained.wait(lock, [this](){ return pending.empty() && !writing; });
+		FILE* previous = output;
+		output = newOutput;
+		return previous;
+	}
+
+	void drain(){
+		std::string chunk;
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true){
+			wakeUp.wait(lock, [this](){ return stopping || !pending.empty(); });
+			if(pending.empty() && stopping){
+				return;
+			}
+			chunk.clear();
+			chunk.swap(pending);
+			writing = true;
+			FILE* file = output;
+			lock.unlock();
+			fwrite(chunk.data(), 1, chunk.size(), file);
+			fflush(file);
+			lock.lock();
+			writing = false;
+			if(pending.empty()){
+				drained.notify_all();
+			}
+		}
+	}
+};
+
+inline Logger& logger(){
+	static Logger instance;
+	return instance;
+}
+
+// One message, formatted in a buffer of the calling thread and logged when the statement ends.
+struct LogLine {
+	LogLevel level;
+	LogBuffer* target;
+	std::ostringstream* stream;
+	std::unique_ptr<std::ostringstream> ownStream; // if a line is formatted while another one is in progress.
+
+	static std::ostringstream* threadStream(){
+		thread_local std::ostringstream stream;
+		return &stream;
+	}
+
+	static bool& threadStreamUsed(){
+		thread_local bool used = false;
+		return used;
+	}
+
+	LogLine(LogLevel lineLevel, LogBuffer* lineTarget = nullptr) : level(lineLevel), target(lineTarget) {
+		if(threadStreamUsed()){
+			ownStream.reset(new std::ostringstream());
+			stream = ownStream.get();
+			return;
+		}
+		threadStreamUsed() = true;
+		stream = threadStream();
+		stream->str(std::string());
+		stream->clear();
+	}
+
+	LogLine(const LogLine&) = delete;
+	LogLine& operator=(const LogLine&) = delete;
+
+	~LogLine(){
+		if(target){
+			target->messages.push_back({ level, stream->str() });
+		} else {
+			logger().write(level, stream->str());
+		}
+		if(!ownStream){
+			threadStreamUsed() = false;
+		}
+	}
+
+	template<typename T>
+	LogLine& operator<<(const T& value){
+		*stream << value;
+		return *this;
+	}
+};
+
+// Turns a streamed line into void, so that both branches of the conditional below have the same type.
+// As & binds looser than <<, the whole line is streamed first, and only when the level is enabled.
+struct LogLineVoidify {
+	void operator&(const LogLine&) const {}
+};
+
+// Single expressions, safe in unbraced if/else.
+#define LOG(level) !logger().enabled(level) ? (void)0 : LogLineVoidify() & LogLine(level)
+#define LOG_TO(buffer, level) !logger().enabled(level) ? (void)0 : LogLineVoidify() & LogLine(level, &(buffer))
@@ -0,0 +1,582 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <algorithm>
+
+// Format of Myst III .m3a archives: an optionally encrypted header describing entries
+// and their subentries, followed by the subentries data.
+
+// Scale of the images produced by the upscaler, relative to the original ones.
+#define UPSCALE_FACTOR 4
+
+// Callback of stbi_write_jpg_to_func, appending the encoded data to a std::vector<unsigned char>.
+inline void writeJPEGToEntryFunc(void *context, void *data, int size){
+	std::vector<unsigned char>& vector = *((std::vector<unsigned char>*)context);
+
+	size_t prevSize = vector.size();
+	vector.resize(prevSize + size);
+	memcpy(&vector[prevSize], data, size);
+}
+
+enum ResourceType {
+		kCubeFace           =  0,
+		kWaterEffectMask    =  1,
+		kLavaEffectMask     =  2,
+		kMagneticEffectMask =  3,
+		kShieldEffectMask   =  4,
+		kSpotItem           =  5,
+		kFrame              =  6,
+		kRawData            =  7,
+		kMovie              =  8,
+		kStillMovie         = 10,
+		kText               = 11,
+		kTextMetadata       = 12,
+		kNumMetadata        = 13,
+		kLocalizedSpotItem  = 69,
+		kLocalizedFrame     = 70,
+		kMultitrackMovie    = 72,
+		kDialogMovie        = 74
+};
+
+inline std::string getResourceTypeName(ResourceType type){
+	static const std::unordered_map<int, std::string> resourceNames = {
+		{ kCubeFace          , "kCubeFace" }, 
+		{ kWaterEffectMask   , "kWaterEffectMask" }, 
+		{ kLavaEffectMask    , "kLavaEffectMask" }, 
+		{ kMagneticEffectMask, "kMagneticEffectMask" }, 
+		{ kShieldEffectMask  , "kShieldEffectMask" }, 
+		{ kSpotItem          , "kSpotItem" }, 
+		{ kFrame             , "kFrame" }, 
+		{ kRawData           , "kRawData" }, 
+		{ kMovie             , "kMovie" }, 
+		{ kStillMovie        , "kStillMovie" }, 
+		{ kText              , "kText" }, 
+		{ kTextMetadata      , "kTextMetadata" }, 
+		{ kNumMetadata       , "kNumMetadata" }, 
+		{ kLocalizedSpotItem , "kLocalizedSpotItem" }, 
+		{ kLocalizedFrame    , "kLocalizedFrame" }, 
+		{ kMultitrackMovie   , "kMultitrackMovie" }, 
+		{ kDialogMovie       , "kDialogMovie" }, 
+	};
+	if(resourceNames.count(type) == 0){
+		return "Unknown";
+	}
+	return resourceNames.at(type);
+}
+
+struct SubEntry {
+	std::vector<uint32_t> metadata;
+	std::vector<unsigned char> data;
+	uint64_t hash{0}; // of the data loaded from the input archive.
+	ResourceType type;
+	uint32_t offset;
+	uint32_t size;
+	unsigned char face;
+};
+
+struct Entry {
+	std::vector<SubEntry> subEntries;
+	std::string name;
+	uint32_t index; // uint24_t
+};
+
+struct Directory {
+	std::vector<Entry> entries;
+	uint32_t size;
+	bool encoded;
+};
+
+struct Buffer {
+	std::vector<unsigned char> data;
+	uint32_t cursor{0};
+
+	template<typename T>
+	T read(){
+		T val = *(reinterpret_cast<T*>(&data[cursor]));
+		cursor += sizeof(T) / sizeof(unsigned char);
+		return val;
+	}
+
+	template<typename T>
+	void write(T val){
+		*(reinterpret_cast<T*>(&data[cursor])) = val;
+		cursor += sizeof(T) / sizeof(unsigned char);
+	}
+
+	uint32_t readUint24_t(){
+		uint32_t value = read<uint16_t>();
+		value |= read<unsigned char>() << 16;
+		return value;
+	}
+
+	void writeUint24_t(uint32_t val){
+		uint16_t v0 = val & 0xFFFF;
+		unsigned char v1 = (val >> 16) & 0xFF;
+		write<uint16_t>(v0);
+		write<unsigned char>(v1);
+	}
+
+	template<typename T>
+	bool contains(){
+		return cursor + sizeof(T) / sizeof(unsigned char) < data.size();
+	}
+
+	std::string readString(uint32_t size){
+		std::string str;
+		str.resize(size);
+		for(uint32_t i = 0; i < size; ++i){
+			str[i] = read<char>();
+		}
+		return str;
+	}
+
+	void writeString(const std::string& str, uint32_t maxSize){
+		const uint32_t charCount = std::min(uint32_t(str.size()), maxSize);
+		for(uint32_t i = 0; i < charCount; ++i){
+			write<char>(str[i]);
+		}
+	}
+
+	void resize(uint32_t sizeInBytes){
+		data.resize(sizeInBytes);
+	}
+
+};
+
+// 64-bit xxHash (XXH64).
+inline uint64_t hashData(const unsigned char* data, size_t size, uint64_t seed = 0){
+	static const uint64_t prime1 = 11400714785074694791ULL;
+	static const uint64_t prime2 = 14029467366897019727ULL;
+	static const uint64_t prime3 =  1609587929392839161ULL;
+	static const uint64_t prime4 =  9650029242287828579ULL;
+	static const uint64_t prime5 =  2870177450012600261ULL;
+
+	auto rotl = [](uint64_t x, int r){ return (x << r) | (x >> (64 - r)); };
+	auto read64 = [](const unsigned char* ptr){ uint64_t v; memcpy(&v, ptr, sizeof(uint64_t)); return v; };
+	auto read32 = [](const unsigned char* ptr){ uint32_t v; memcpy(&v, ptr, sizeof(uint32_t)); return v; };
+	auto round = [&](uint64_t acc, uint64_t input){ return rotl(acc + input * prime2, 31) * prime1; };
+	auto merge = [&](uint64_t acc, uint64_t val){ return (acc ^ round(0, val)) * prime1 + prime4; };
+
+	const unsigned char* ptr = data;
+	const unsigned char* end = data + size;
+	uint64_t h;
+
+	if(size >= 32){
+		uint64_t v1 = seed + prime1 + prime2;
+		uint64_t v2 = seed + prime2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - prime1;
+		do {
+			v1 = round(v1, read64(ptr));
+			v2 = round(v2, read64(ptr + 8));
+			v3 = round(v3, read64(ptr + 16));
+			v4 = round(v4, read64(ptr + 24));
+			ptr += 32;
+		} while(ptr + 32 <= end);
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge(h, v1);
+		h = merge(h, v2);
+		h = merge(h, v3);
+		h = merge(h, v4);
+	} else {
+		h = seed + prime5;
+	}
+	h += size;
+
+	for(; ptr + 8 <= end; ptr += 8){
+		h = rotl(h ^ round(0, read64(ptr)), 27) * prime1 + prime4;
+	}
+	if(ptr + 4 <= end){
+		h = rotl(h ^ (uint64_t(read32(ptr)) * prime1), 23) * prime2 + prime3;
+		ptr += 4;
+	}
+	for(; ptr < end; ++ptr){
+		h = rotl(h ^ (uint64_t(*ptr) * prime5), 11) * prime1;
+	}
+
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	h *= prime3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Header size in words, from the first word of the file.
+inline uint32_t decodeHeaderSize(uint32_t firstWord, bool& encrypted) {
+	static const uint32_t addKey = 0x3C6EF35F;
+
+	encrypted = firstWord > 1000000;
+	return encrypted ? firstWord ^ addKey : firstWord;
+}
+
+inline bool decryptHeader(FILE* file, Buffer& buffer) {
+	static const uint32_t addKey = 0x3C6EF35F;
+	static const uint32_t multKey = 0x0019660D;
+
+	fseek(file, 0, SEEK_SET);
+
+	uint32_t data;
+	uint32_t size = 0;
+	fread(&size, sizeof(uint32_t), 1, file);
+
+	bool encrypted = false;
+	decodeHeaderSize(size, encrypted);
+	fseek(file, 0, SEEK_SET);
+
+	if(encrypted) {
+		uint32_t decryptedSize = size ^ addKey;
+		buffer.resize(decryptedSize * sizeof(uint32_t));
+
+		uint32_t currentKey = 0;
+		for (uint32_t i = 0; i < decryptedSize; ++i) {
+			currentKey += addKey;
+			fread(&data, sizeof(uint32_t), 1, file);
+			buffer.write<uint32_t>(data ^ currentKey);
+			currentKey *= multKey;
+		}
+	} else {
+		buffer.resize(size * sizeof(uint32_t));
+		fread(buffer.data.data(), sizeof(uint32_t), size, file);
+	}
+	buffer.cursor = 0;
+	return encrypted;
+}
+
+inline void encryptHeader(Buffer& buffer, FILE* file) {
+	static const uint32_t addKey = 0x3C6EF35F;
+	static const uint32_t multKey = 0x0019660D;
+
+	fseek(file, 0, SEEK_SET);
+	buffer.cursor = 0;
+
+	// 34e35882		// 512a91e7
+	// e7d60f6e		// 8c00d905
+	uint32_t size = buffer.data.size() / sizeof(uint32_t);
+
+	uint32_t currentKey = 0;
+	for (uint32_t i = 0; i < size; ++i) {
+		currentKey += addKey;
+		uint32_t data = buffer.read<uint32_t>() ^ currentKey;
+		fwrite(&data, sizeof(uint32_t), 1, file);
+		currentKey *= multKey;
+	}
+}
+
+// Metadata blocks are using size and offset fields to store metadata.
+inline bool storesData(ResourceType type){
+	return type != kNumMetadata && type != kTextMetadata;
+}
+
+// If allocateData is set, data is sized to receive the subentry content.
+inline void readSubEntry(Buffer &buffer, SubEntry& subEntry, bool allocateData = true) {
+	
+	subEntry.offset = buffer.read<uint32_t>();
+
+	subEntry.size = buffer.read<uint32_t>();
+	uint16_t metadataSize = buffer.read<uint16_t>();
+
+	subEntry.face = buffer.read<unsigned char>();
+	subEntry.type = (ResourceType)buffer.read<unsigned char>();
+
+	if(allocateData && storesData(subEntry.type)){
+		subEntry.data.resize(subEntry.size);
+	}
+	subEntry.metadata.resize(metadataSize);
+
+	for (uint i = 0; i < metadataSize; ++i) {
+		subEntry.metadata[i] = buffer.read<uint32_t>();
+	}
+
+}
+
+inline void readEntry(Buffer &buffer, Entry& entry, bool expectNames, bool allocateData = true) {
+		
+	if(expectNames){
+		entry.name = buffer.readString(4);
+	}
+	
+	entry.index = buffer.readUint24_t();
+
+	unsigned char subItemCount = buffer.read<unsigned char>();
+		
+	entry.subEntries.resize(subItemCount);
+
+	for (uint i = 0; i < subItemCount; i++) {
+		readSubEntry(buffer, entry.subEntries[i], allocateData);
+	}
+
+}
+
+inline void readDirectory(FILE* file, Directory& directory, bool expectNames, bool allocateData = true) {
+	Buffer buffer;
+
+	directory.encoded = decryptHeader(file, buffer);
+	directory.size = buffer.read<uint32_t>();
+	assert(directory.size * sizeof(uint32_t) == buffer.data.size());
+	while(buffer.contains<uint32_t>()) {
+		directory.entries.emplace_back();
+		readEntry(buffer, directory.entries.back(), expectNames, allocateData);
+	}
+}
+
+
+inline void writeSubEntry(const SubEntry& subEntry, Buffer &buffer) {
+	
+	buffer.write<uint32_t>(subEntry.offset);
+
+	buffer.write<uint32_t>(subEntry.size);
+	buffer.write<uint16_t>(subEntry.metadata.size());
+
+	buffer.write<unsigned char>(subEntry.face);
+	buffer.write<unsigned char>(subEntry.type);
+
+	for (uint i = 0; i < subEntry.metadata.size(); i++) {
+		buffer.write<uint32_t>(subEntry.metadata[i]);
+	}
+
+}
+
+inline void writeEntry(const Entry& entry, Buffer &buffer) {
+		
+	if(!entry.name.empty()){
+		buffer.writeString(entry.name, 4);
+	}
+	buffer.writeUint24_t(entry.index);
+	buffer.write<unsigned char>(entry.subEntries.size());
+	
+	for (const SubEntry& subEntry : entry.subEntries) {
+		writeSubEntry(subEntry, buffer);
+	}
+
+}
+
+inline void writeDirectory(const Directory& directory, FILE* file) {
+	Buffer buffer;
+	buffer.resize(directory.size * sizeof(uint32_t));
+	buffer.write<uint32_t>(directory.size);
+	
+	for(const Entry& entry : directory.entries){
+		writeEntry(entry, buffer);
+	}
+	assert(buffer.data.size() == directory.size * sizeof(uint32_t));
+
+	if(directory.encoded){
+		encryptHeader(buffer, file);
+	} else {
+		fwrite(buffer.data.data(), sizeof(unsigned char), buffer.data.size(), file);
+	}
+}
+
+inline void logDirectory(const Directory& directory, std::ostream& stream = std::cout) {
+	stream << "Directory: size: " << directory.size << ", " << (directory.encoded ? "encoded" : "readable") << std::endl;
+
+	for(const Entry& entry : directory.entries){
+		stream << "* Entry: \"" << entry.name << "\", index:" << entry.index << std::endl;
+
+		for(const SubEntry& subEntry : entry.subEntries){
+			stream << "\t* Subentry: " << getResourceTypeName(subEntry.type) << ", face " << int(subEntry.face) << ", offset:" << subEntry.offset << ", size:" << subEntry.size << std::endl;
+			
+			const size_t metadataToDisplayCount = std::min(size_t(4), subEntry.metadata.size());
+			if(metadataToDisplayCount != 0){
+				stream << "\t\tMetadata (" << subEntry.metadata.size() << ")";
+				for(size_t i = 0; i < metadataToDisplayCount; ++i){
+					stream << ", " << subEntry.metadata[i];
+				}
+				stream << std::endl;
+			}
+		}
+	} 
+}
+
+// Name of the file corresponding to a subentry in the upscaled directory, without the suffix and extension.
+// Empty for subentries that are not images.
+inline std::string getSubEntryFileStem(const std::string& entryFullName, ResourceType type, unsigned char face){
+	static const std::string cubeSuffixes[] = {"", "back", "bottom", "front", "left", "right", "top"};
+
+	if(type == kSpotItem){
+		return entryFullName + "-" + std::to_string(type) + "-" + std::to_string(face);
+	}
+	if(type == kLocalizedSpotItem || type == kLocalizedFrame){
+		return entryFullName + "-" + std::to_string(type - 24) + "-" + std::to_string(face);
+	}
+	if(type == kFrame){
+		return entryFullName + "-" + std::to_string(type);
+	}
+	if(type == kCubeFace && face < 7){
+		return entryFullName + "-" + cubeSuffixes[face];
+	}
+	return "";
+}
+
+inline std::string getSubEntryFileStem(const std::string& entryFullName, const SubEntry& subEntry){
+	return getSubEntryFileStem(entryFullName, subEntry.type, subEntry.face);
+}
+
+// Directory stored as flat arrays, for read-only scans over many archives. Entries and
+// subentries are identified by their position, and all metadata lives in a single pool.
+// Containers keep their capacity when cleared, so a directory can be reused to read many archives.
+struct FlatDirectory {
+	// Per entry, subentries of entry i are in [firstSubEntries[i], firstSubEntries[i+1]).
+	std::vector<uint32_t> indices;
+	std::vector<char> names; // 4 characters per entry, if the archive has names.
+	std::vector<uint32_t> firstSubEntries;
+	// Per subentry.
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> sizes;
+	std::vector<unsigned char> types;
+	std::vector<unsigned char> faces;
+	std::vector<uint32_t> entryIds;
+	std::vector<uint32_t> metadataStarts;
+	std::vector<uint16_t> metadataCounts;
+	std::vector<uint32_t> metadata;
+	uint32_t size{0};
+	bool encoded{false};
+
+	size_t entryCount() const {
+		return indices.size();
+	}
+
+	size_t subEntryCount() const {
+		return offsets.size();
+	}
+
+	// Empty if the archive has no names.
+	std::string name(uint32_t entry) const {
+		if(names.empty()){
+			return "";
+		}
+		const char* str = names.data() + 4 * entry;
+		return std::string(str, strnlen(str, 4));
+	}
+
+	ResourceType type(uint32_t subEntry) const {
+		return ResourceType(types[subEntry]);
+	}
+
+	const uint32_t* subEntryMetadata(uint32_t subEntry) const {
+		return metadata.data() + metadataStarts[subEntry];
+	}
+
+	void clear(){
+		indices.clear();
+		names.clear();
+		firstSubEntries.clear();
+		offsets.clear();
+		sizes.clear();
+		types.clear();
+		faces.clear();
+		entryIds.clear();
+		metadataStarts.clear();
+		metadataCounts.clear();
+		metadata.clear();
+	}
+};
+
+// Same parsing as readDirectory. The header is scanned once to size all arrays before filling them.
+inline void readFlatDirectory(FILE* file, FlatDirectory& directory, bool expectNames) {
+	Buffer buffer;
+	directory.clear();
+	directory.encoded = decryptHeader(file, buffer);
+	directory.size = buffer.read<uint32_t>();
+	assert(directory.size * sizeof(uint32_t) == buffer.data.size());
+
+	size_t entryCount = 0;
+	size_t subEntryCount = 0;
+	size_t metadataCount = 0;
+	while(buffer.contains<uint32_t>()) {
+		buffer.cursor += (expectNames ? 4 : 0) + 3;
+		const unsigned char subItemCount = buffer.read<unsigned char>();
+		for(uint i = 0; i < subItemCount; ++i){
+			buffer.cursor += 8;
+			const uint16_t metadataSize = buffer.read<uint16_t>();
+			buffer.cursor += 2 + metadataSize * sizeof(uint32_t);
+			metadataCount += metadataSize;
+		}
+		++entryCount;
+		subEntryCount += subItemCount;
+	}
+	directory.indices.reserve(entryCount);
+	directory.names.reserve(expectNames ? 4 * entryCount : 0);
+	directory.firstSubEntries.reserve(entryCount + 1);
+	directory.offsets.reserve(subEntryCount);
+	directory.sizes.reserve(subEntryCount);
+	directory.types.reserve(subEntryCount);
+	directory.faces.reserve(subEntryCount);
+	directory.entryIds.reserve(subEntryCount);
+	directory.metadataStarts.reserve(subEntryCount);
+	directory.metadataCounts.reserve(subEntryCount);
+	directory.metadata.reserve(metadataCount);
+
+	buffer.cursor = sizeof(uint32_t);
+	while(buffer.contains<uint32_t>()) {
+		const uint32_t entryId = directory.indices.size();
+		if(expectNames){
+			for(uint i = 0; i < 4; ++i){
+				directory.names.push_back(buffer.read<char>());
+			}
+		}
+		directory.indices.push_back(buffer.readUint24_t());
+		directory.firstSubEntries.push_back(directory.offsets.size());
+
+		const unsigned char subItemCount = buffer.read<unsigned char>();
+		for(uint i = 0; i < subItemCount; ++i){
+			directory.offsets.push_back(buffer.read<uint32_t>());
+			directory.sizes.push_back(buffer.read<uint32_t>());
+			const uint16_t metadataSize = buffer.read<uint16_t>();
+			directory.faces.push_back(buffer.read<unsigned char>());
+			directory.types.push_back(buffer.read<unsigned char>());
+			directory.entryIds.push_back(entryId);
+			directory.metadataStarts.push_back(directory.metadata.size());
+			directory.metadataCounts.push_back(metadataSize);
+			for(uint j = 0; j < metadataSize; ++j){
+				directory.metadata.push_back(buffer.read<uint32_t>());
+			}
+		}
+	}
+	directory.firstSubEntries.push_back(directory.offsets.size());
+}
+
+inline void writeFlatDirectory(const FlatDirectory& directory, FILE* file) {
+	Buffer buffer;
+	buffer.resize(directory.size * sizeof(uint32_t));
+	buffer.write<uint32_t>(directory.size);
+
+	for(uint32_t entry = 0; entry < directory.entryCount(); ++entry){
+		if(!directory.names.empty()){
+			for(uint i = 0; i < 4; ++i){
+				buffer.write<char>(directory.names[4 * entry + i]);
+			}
+		}
+		buffer.writeUint24_t(directory.indices[entry]);
+		const uint32_t first = directory.firstSubEntries[entry];
+		const uint32_t last = directory.firstSubEntries[entry + 1];
+		buffer.write<unsigned char>(last - first);
+		for(uint32_t subEntry = first; subEntry < last; ++subEntry){
+			buffer.write<uint32_t>(directory.offsets[subEntry]);
+			buffer.write<uint32_t>(directory.sizes[subEntry]);
+			buffer.write<uint16_t>(directory.metadataCounts[subEntry]);
+			buffer.write<unsigned char>(directory.faces[subEntry]);
+			buffer.write<unsigned char>(directory.types[subEntry]);
+			const uint32_t* metadata = directory.subEntryMetadata(subEntry);
+			for(uint i = 0; i < directory.metadataCounts[subEntry]; ++i){
+				buffer.write<uint32_t>(metadata[i]);
+			}
+		}
+	}
+	assert(buffer.data.size() == directory.size * sizeof(uint32_t));
+
+	if(directory.encoded){
+		encryptHeader(buffer, file);
+	} else {
+		fwrite(buffer.data.data(), sizeof(unsigned char), buffer.data.size(), file);
+	}
+}
@@ -0,0 +1,337 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "libs/filesystem.hpp"
+#include "M3Archive.hpp"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "libs/stb_image_write.h"
+
+namespace fs = ghc::filesystem;
+
+// Generate synthetic archives with the same structure as the game ones, for tests and benchmarks.
+// Images are procedural, so the same settings and seed always produce the same archive.
+
+struct Resolution {
+	int width;
+	int height;
+};
+
+struct GeneratorSettings {
+	fs::path outputPath;
+	fs::path upscaledDir; // directory of the archive in the upscaled tree, optional.
+	unsigned int entries{4};
+	// Per entry.
+	unsigned int cubeFaces{6};
+	unsigned int frames{0};
+	unsigned int spotItems{1};
+	unsigned int localizedSpotItems{1};
+	unsigned int localizedFrames{0};
+	unsigned int rawBlobs{1};
+	unsigned int movies{0};
+	unsigned int metadataBlocks{1};
+	Resolution cubeResolution{640, 640};
+	Resolution frameResolution{640, 480};
+	Resolution spotResolution{64, 64};
+	unsigned int blobSize{4096};
+	unsigned int quality{90};
+	unsigned int seed{0};
+	bool encrypted{false};
+	bool names{false};
+};
+
+// Smooth gradients with a few sharp shapes and some noise, so that the encoder and resizers have real work to do.
+std::vector<unsigned char> generateJPEG(const Resolution& resolution, unsigned int quality, uint32_t seed){
+	std::mt19937 random(seed);
+	const int w = resolution.width;
+	const int h = resolution.height;
+	const float phaseX = float(random() % 1000) / 100.0f;
+	const float phaseY = float(random() % 1000) / 100.0f;
+	const int tint[3] = { int(random() % 128), int(random() % 128), int(random() % 128) };
+	const int discX = random() % w;
+	const int discY = random() % h;
+	const int discRadius = std::max(w, h) / 6 + 1;
+
+	std::vector<unsigned char> pixels(size_t(w) * h * 3);
+	std::uniform_int_distribution<int> noise(-8, 8);
+	for(int y = 0; y < h; ++y){
+		for(int x = 0; x < w; ++x){
+			const int gradient = int(64.0f * (std::sin(phaseX + 6.0f * x / w) + std::cos(phaseY + 4.0f * y / h)));
+			const bool inDisc = (x - discX) * (x - discX) + (y - discY) * (y - discY) < discRadius * discRadius;
+			for(int c = 0; c < 3; ++c){
+				const int value = tint[c] + 64 + gradient + (inDisc ? 60 : 0) + noise(random);
+				pixels[(size_t(y) * w + x) * 3 + c] = (unsigned char)std::min(255, std::max(0, value));
+			}
+		}
+	}
+	std::vector<unsigned char> data;
+	stbi_write_jpg_to_func(writeJPEGToEntryFunc, (void*)&data, w, h, 3, pixels.data(), quality);
+	return data;
+}
+
+struct GeneratedImage {
+	const SubEntry* subEntry;
+	std::string entryFullName;
+	Resolution resolution;
+	uint32_t seed;
+};
+
+void addSubEntry(Entry& entry, ResourceType type, unsigned char face, std::vector<uint32_t> metadata){
+	entry.subEntries.emplace_back();
+	SubEntry& subEntry = entry.subEntries.back();
+	subEntry.type = type;
+	subEntry.face = face;
+	subEntry.metadata = std::move(metadata);
+	subEntry.offset = 0;
+	subEntry.size = 0;
+}
+
+// Parse a whole string as a decimal count in [minValue, maxValue].
+bool parseCount(const std::string& str, unsigned int& count, unsigned int minValue = 0, unsigned int maxValue = UINT_MAX){
+	if(str.empty() || !std::isdigit((unsigned char)str[0])){
+		return false;
+	}
+	char* end = nullptr;
+	errno = 0;
+	const unsigned long value = strtoul(str.c_str(), &end, 10);
+	if(errno == ERANGE || *end != '\0' || value < minValue || value > maxValue){
+		return false;
+	}
+	count = (unsigned int)value;
+	return true;
+}
+
+// Either WxH or a single size for square images.
+bool parseResolution(const std::string& str, Resolution& resolution){
+	const size_t separator = str.find('x');
+	unsigned int width = 0;
+	unsigned int height = 0;
+	if(!parseCount(str.substr(0, separator), width, 1, INT_MAX)){
+		return false;
+	}
+	if(separator == std::string::npos){
+		height = width;
+	} else if(!parseCount(str.substr(separator + 1), height, 1, INT_MAX)){
+		return false;
+	}
+	resolution = { int(width), int(height) };
+	return true;
+}
+
+int main(int argc, char** argv){
+
+	const char* usage = "executable path/to/output.m3a [-entries N] [-seed N] [-encrypted] [-names] [-cube-faces 0-6] [-frames 0|1] [-spot-items N] [-localized-spot-items N] [-localized-frames N] [-raw N] [-movies N] [-metadata N] [-cube-size WxH] [-frame-size WxH] [-spot-size WxH] [-blob-size N] [-quality 1-100] [-upscaled path/to/upscaled_dir]";
+	if(argc < 2){
+		std::cout << usage << std::endl;
+		return 0;
+	}
+
+	GeneratorSettings settings;
+	settings.outputPath = argv[1];
+	for(int i = 2; i < argc; ++i){
+		std::string arg(argv[i]);
+		// Also accept double dash options.
+		if(arg.compare(0, 2, "--") == 0){
+			arg.erase(0, 1);
+		}
+		const bool hasValue = i + 1 < argc;
+		bool valid = true;
+		if(arg == "-encrypted"){
+			settings.encrypted = true;
+		} else if(arg == "-names"){
+			settings.names = true;
+		} else if(arg == "-entries" && hasValue){
+			valid = parseCount(argv[++i], settings.entries);
+		} else if(arg == "-seed" && hasValue){
+			valid = parseCount(argv[++i], settings.seed);
+		} else if(arg == "-cube-faces" && hasValue){
+			valid = parseCount(argv[++i], settings.cubeFaces, 0, 6);
+		} else if(arg == "-frames" && hasValue){
+			// Frames are identified by their entry only, so there is at most one per entry.
+			valid = parseCount(argv[++i], settings.frames, 0, 1);
+		} else if(arg == "-spot-items" && hasValue){
+			valid = parseCount(argv[++i], settings.spotItems);
+		} else if(arg == "-localized-spot-items" && hasValue){
+			valid = parseCount(argv[++i], settings.localizedSpotItems);
+		} else if(arg == "-localized-frames" && hasValue){
+			valid = parseCount(argv[++i], settings.localizedFrames);
+		} else if(arg == "-raw" && hasValue){
+			valid = parseCount(argv[++i], settings.rawBlobs);
+		} else if(arg == "-movies" && hasValue){
+			valid = parseCount(argv[++i], settings.movies);
+		} else if(arg == "-metadata" && hasValue){
+			valid = parseCount(argv[++i], settings.metadataBlocks);
+		} else if(arg == "-cube-size" && hasValue){
+			valid = parseResolution(argv[++i], settings.cubeResolution);
+		} else if(arg == "-frame-size" && hasValue){
+			valid = parseResolution(argv[++i], settings.frameResolution);
+		} else if(arg == "-spot-size" && hasValue){
+			valid = parseResolution(argv[++i], settings.spotResolution);
+		} else if(arg == "-blob-size" && hasValue){
+			valid = parseCount(argv[++i], settings.blobSize);
+		} else if(arg == "-quality" && hasValue){
+			valid = parseCount(argv[++i], settings.quality, 1, 100);
+		} else if(arg == "-upscaled" && hasValue){
+			settings.upscaledDir = argv[++i];
+		} else {
+			std::cout << "Unknown option " << arg << (hasValue ? "" : " or missing value") << std::endl;
+			std::cout << usage << std::endl;
+			return -1;
+		}
+		if(!valid){
+			std::cout << "Invalid value " << argv[i] << " for option " << arg << std::endl;
+			std::cout << usage << std::endl;
+			return -1;
+		}
+	}
+
+	const unsigned int subEntryCount = settings.cubeFaces + settings.frames + settings.spotItems + settings.localizedSpotItems
+		+ settings.localizedFrames + settings.rawBlobs + settings.movies + settings.metadataBlocks;
+	if(subEntryCount > 255){
+		std::cout << "At most 255 subentries per entry are supported." << std::endl;
+		return -1;
+	}
+
+	// Same naming as the packer for archives without names.
+	const std::string baseFileName = settings.outputPath.stem().string();
+	const std::string defaultEntryName = baseFileName.substr(0, 4);
+	std::mt19937 random(settings.seed);
+	auto draw = [&random](uint32_t range){ return uint32_t(random() % range); };
+
+	// Build the directory.
+	Directory directory;
+	directory.encoded = settings.encrypted;
+	std::vector<GeneratedImage> images;
+	for(unsigned int e = 0; e < settings.entries; ++e){
+		directory.entries.emplace_back();
+		Entry& entry = directory.entries.back();
+		entry.index = e + 1;
+		if(settings.names){
+			entry.name.resize(4);
+			for(char& c : entry.name){
+				c = 'a' + random() % 26;
+			}
+		}
+		for(unsigned int f = 0; f < settings.cubeFaces; ++f){
+			addSubEntry(entry, kCubeFace, f + 1, {});
+		}
+		for(unsigned int f = 0; f < settings.frames; ++f){
+			addSubEntry(entry, kFrame, 1, {});
+		}
+		// Spot items store their position in the first metadata words.
+		for(unsigned int f = 0; f < settings.spotItems; ++f){
+			addSubEntry(entry, kSpotItem, f + 1, { draw(512), draw(512), 1, 0 });
+		}
+		for(unsigned int f = 0; f < settings.localizedSpotItems; ++f){
+			addSubEntry(entry, kLocalizedSpotItem, f + 1, { draw(512), draw(512) });
+		}
+		for(unsigned int f = 0; f < settings.localizedFrames; ++f){
+			addSubEntry(entry, kLocalizedFrame, f + 1, {});
+		}
+		for(unsigned int f = 0; f < settings.rawBlobs; ++f){
+			addSubEntry(entry, kRawData, f, {});
+		}
+		for(unsigned int f = 0; f < settings.movies; ++f){
+			addSubEntry(entry, kMovie, f, {});
+		}
+		// Metadata blocks use the offset and size fields as values.
+		for(unsigned int f = 0; f < settings.metadataBlocks; ++f){
+			addSubEntry(entry, kNumMetadata, f, { uint32_t(random()), uint32_t(random()), uint32_t(random()) });
+			entry.subEntries.back().offset = random();
+			entry.subEntries.back().size = random();
+		}
+	}
+
+	// Generate the data, images are listed for the upscaled tree.
+	for(Entry& entry : directory.entries){
+		const std::string entryFullName = (entry.name.empty() ? defaultEntryName : entry.name) + "-" + std::to_string(entry.index);
+		for(SubEntry& subEntry : entry.subEntries){
+			if(!storesData(subEntry.type)){
+				continue;
+			}
+			const uint32_t seed = random();
+			if(subEntry.type == kRawData || subEntry.type == kMovie){
+				std::mt19937 blobRandom(seed);
+				subEntry.data.resize(settings.blobSize);
+				for(unsigned char& byte : subEntry.data){
+					byte = (unsigned char)blobRandom();
+				}
+			} else {
+				const Resolution& resolution = subEntry.type == kCubeFace ? settings.cubeResolution : ((subEntry.type == kFrame || subEntry.type == kLocalizedFrame) ? settings.frameResolution : settings.spotResolution);
+				subEntry.data = generateJPEG(resolution, settings.quality, seed);
+				images.push_back({ &subEntry, entryFullName, resolution, seed });
+			}
+			subEntry.size = subEntry.data.size();
+		}
+	}
+
+	// Header size in words: size, then per entry the optional name, index and count, then per subentry three words and metadata.
+	directory.size = 1;
+	for(const Entry& entry : directory.entries){
+		directory.size += (settings.names ? 1 : 0) + 1;
+		for(const SubEntry& subEntry : entry.subEntries){
+			directory.size += 3 + subEntry.metadata.size();
+		}
+	}
+	uint32_t currentOffset = directory.size * sizeof(uint32_t);
+	for(Entry& entry : directory.entries){
+		for(SubEntry& subEntry : entry.subEntries){
+			if(storesData(subEntry.type)){
+				subEntry.offset = currentOffset;
+				currentOffset += subEntry.data.size();
+			}
+		}
+	}
+
+	fs::create_directories(settings.outputPath.parent_path());
+	FILE* outFile = fopen(settings.outputPath.c_str(), "wb");
+	if(!outFile){
+		std::cout << "Could not write file at path " << settings.outputPath << std::endl;
+		return -1;
+	}
+	writeDirectory(directory, outFile);
+	for(const Entry& entry : directory.entries){
+		for(const SubEntry& subEntry : entry.subEntries){
+			if(storesData(subEntry.type)){
+				fseek(outFile, subEntry.offset, SEEK_SET);
+				fwrite(subEntry.data.data(), sizeof(unsigned char), subEntry.data.size(), outFile);
+			}
+		}
+	}
+	fclose(outFile);
+	std::cout << "Wrote " << settings.outputPath << " (" << directory.entries.size() << " entries, " << currentOffset << " bytes)" << std::endl;
+
+	// Upscaled versions, at the resolution the packer expects.
+	if(!settings.upscaledDir.empty()){
+		std::string baseExtension = settings.outputPath.extension().string();
+		if(!baseExtension.empty() && baseExtension[0] == '.'){
+			baseExtension = baseExtension.substr(1);
+		}
+		const fs::path upscaledArchivePath = settings.upscaledDir / (baseFileName + "-" + baseExtension);
+		fs::create_directories(upscaledArchivePath);
+		for(const GeneratedImage& image : images){
+			const Resolution resolution = { UPSCALE_FACTOR * image.resolution.width, UPSCALE_FACTOR * image.resolution.height };
+			const std::vector<unsigned char> data = generateJPEG(resolution, settings.quality, image.seed);
+			const fs::path filePath = upscaledArchivePath / (getSubEntryFileStem(image.entryFullName, *image.subEntry) + "-edit.jpeg");
+			FILE* file = fopen(filePath.c_str(), "wb");
+			if(!file){
+				std::cout << "Could not write file at path " << filePath << std::endl;
+				return -1;
+			}
+			fwrite(data.data(), sizeof(unsigned char), data.size(), file);
+			fclose(file);
+		}
+		std::cout << "Wrote " << images.size() << " upscaled images to " << upscaledArchivePath << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,641 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "libs/filesystem.hpp"
+#include "M3Archive.hpp"
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#define STBI_ONLY_JPEG
+
+#include "libs/stb_image.h"
+#include "libs/stb_image_resize.h"
+#include "libs/stb_image_write.h"
+
+namespace fs = ghc::filesystem;
+
+// Benchmarks of each step of the packer, then of complete runs of the packer executable over
+// archives produced by the generator. Results are written as JSON and can be compared to a
+// previous run, the program fails if a benchmark is slower than the baseline by more than the threshold.
+
+#define BENCHMARK_VERSION 1
+
+const int kImageChannels = 3;
+const unsigned int kResizeBandRows = 64;
+
+struct BenchmarkSettings {
+	fs::path workDir;
+	fs::path generatorPath;
+	fs::path packerPath;
+	fs::path outputPath;
+	fs::path baselinePath;
+	std::string filter;
+	std::vector<unsigned int> threads;
+	double threshold{10.0}; // in percents.
+	unsigned int samples{7};
+	double sampleTime{0.05}; // in seconds.
+	bool quick{false};
+};
+
+struct BenchmarkResult {
+	std::string name;
+	uint64_t iterations;
+	double medianNs;
+	double minNs;
+	uint64_t bytes; // processed per iteration, 0 if not relevant.
+};
+
+// Prevent the compiler from removing the work of benchmarks.
+volatile uint64_t benchmarkSink = 0;
+
+double elapsedNs(const std::chrono::steady_clock::time_point& start){
+	return double(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+struct Benchmarks {
+	const BenchmarkSettings& settings;
+	std::vector<BenchmarkResult> results;
+
+	explicit Benchmarks(const BenchmarkSettings& benchmarkSettings) : settings(benchmarkSettings) {}
+
+	bool selected(const std::string& name) const {
+		return settings.filter.empty() || name.find(settings.filter) != std::string::npos;
+	}
+
+	// Each sample runs the function enough times to last about the sample time.
+	void run(const std::string& name, uint64_t bytes, const std::function<void()>& function){
+		if(!selected(name)){
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		function();
+		const double firstNs = std::max(elapsedNs(start), 1.0);
+		const uint64_t iterations = std::max(uint64_t(1), uint64_t(settings.sampleTime * 1e9 / firstNs));
+
+		std::vector<double> samples;
+		for(unsigned int s = 0; s < settings.samples; ++s){
+			start = std::chrono::steady_clock::now();
+			for(uint64_t i = 0; i < iterations; ++i){
+				function();
+			}
+			samples.push_back(elapsedNs(start) / double(iterations));
+		}
+		record(name, iterations, bytes, samples);
+	}
+
+	void record(const std::string& name, uint64_t iterations, uint64_t bytes, std::vector<double> samples){
+		std::sort(samples.begin(), samples.end());
+		const BenchmarkResult result = { name, iterations, samples[samples.size() / 2], samples[0], bytes };
+		results.push_back(result);
+		std::cout << name << ": " << (result.medianNs / 1e6) << "ms (min " << (result.minNs / 1e6) << "ms";
+		if(bytes != 0){
+			std::cout << ", " << (double(bytes) / result.medianNs * 1e9 / (1024.0 * 1024.0)) << "MB/s";
+		}
+		std::cout << ")" << std::endl;
+	}
+};
+
+// Start an executable, its output is discarded.
+bool spawnProcess(const std::vector<std::string>& args, pid_t& pid){
+	std::vector<char*> argv;
+	std::vector<std::string> argsCopy(args);
+	for(std::string& arg : argsCopy){
+		argv.push_back(&arg[0]);
+	}
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	const int res = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	return res == 0;
+}
+
+bool waitProcess(pid_t pid){
+	int status = 0;
+	while(waitpid(pid, &status, 0) < 0){
+		if(errno != EINTR){
+			return false;
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Run an executable and wait for it, its output is discarded.
+bool runProcess(const std::vector<std::string>& args){
+	pid_t pid;
+	return spawnProcess(args, pid) && waitProcess(pid);
+}
+
+bool readFile(const fs::path& path, std::vector<unsigned char>& data){
+	std::ifstream file(path, std::ios::binary);
+	if(!file){
+		return false;
+	}
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
+
+// Both directories contain the same files with the same content.
+bool sameDirectories(const fs::path& dirA, const fs::path& dirB){
+	std::vector<fs::path> filesA, filesB;
+	for(const fs::directory_entry& item : fs::recursive_directory_iterator(dirA)){
+		if(item.is_regular_file()){
+			filesA.push_back(item.path().lexically_relative(dirA));
+		}
+	}
+	for(const fs::directory_entry& item : fs::recursive_directory_iterator(dirB)){
+		if(item.is_regular_file()){
+			filesB.push_back(item.path().lexically_relative(dirB));
+		}
+	}
+	std::sort(filesA.begin(), filesA.end());
+	std::sort(filesB.begin(), filesB.end());
+	if(filesA != filesB){
+		return false;
+	}
+	std::vector<unsigned char> dataA, dataB;
+	for(const fs::path& file : filesA){
+		if(!readFile(dirA / file, dataA) || !readFile(dirB / file, dataB) || dataA != dataB){
+			return false;
+		}
+	}
+	return true;
+}
+
+// Content written to a temporary file by the given function.
+std::vector<unsigned char> writtenBytes(const std::function<void(FILE*)>& write){
+	std::vector<unsigned char> data;
+	FILE* file = tmpfile();
+	if(!file){
+		return data;
+	}
+	write(file);
+	data.resize(ftell(file));
+	fseek(file, 0, SEEK_SET);
+	if(fread(data.data(), sizeof(unsigned char), data.size(), file) != data.size()){
+		data.clear();
+	}
+	fclose(file);
+	return data;
+}
+
+// Archives with large headers for the directory benchmarks, and one with full size cube faces for images.
+bool generateMicroData(const BenchmarkSettings& settings){
+	const fs::path dataDir = settings.workDir / "micro";
+	const std::string entries = settings.quick ? "500" : "2000";
+	const std::vector<std::string> small = { "-entries", entries, "-cube-size", "8", "-spot-size", "8", "-blob-size", "16" };
+	std::vector<std::string> plain = { settings.generatorPath.string(), (dataDir / "plain.m3a").string() };
+	plain.insert(plain.end(), small.begin(), small.end());
+	std::vector<std::string> encrypted = { settings.generatorPath.string(), (dataDir / "encrypted.m3a").string(), "-encrypted" };
+	encrypted.insert(encrypted.end(), small.begin(), small.end());
+	const std::vector<std::string> faces = { settings.generatorPath.string(), (dataDir / "faces.m3a").string(), "-entries", "1", "-cube-faces", "1",
+		"-spot-items", "0", "-localized-spot-items", "0", "-raw", "0", "-metadata", "0" };
+	return runProcess(plain) && runProcess(encrypted) && runProcess(faces);
+}
+
+// Returns false if a benchmark could not run or produced a wrong result.
+bool runMicroBenchmarks(Benchmarks& benchmarks, const BenchmarkSettings& settings){
+	const fs::path dataDir = settings.workDir / "micro";
+
+	// Buffer accesses, as done when parsing headers.
+	{
+		const uint32_t wordCount = 1 << 18;
+		Buffer buffer;
+		buffer.resize(wordCount * sizeof(uint32_t));
+		benchmarks.run("buffer/write", wordCount * sizeof(uint32_t), [&buffer, wordCount](){
+			buffer.cursor = 0;
+			for(uint32_t i = 0; i < wordCount / 2; ++i){
+				buffer.write<uint32_t>(i);
+				buffer.writeUint24_t(i);
+				buffer.write<unsigned char>(i);
+			}
+			benchmarkSink += buffer.cursor;
+		});
+		benchmarks.run("buffer/read", wordCount * sizeof(uint32_t), [&buffer, wordCount](){
+			buffer.cursor = 0;
+			uint64_t sum = 0;
+			for(uint32_t i = 0; i < wordCount / 2; ++i){
+				sum += buffer.read<uint32_t>();
+				sum += buffer.readUint24_t();
+				sum += buffer.read<unsigned char>();
+			}
+			benchmarkSink += sum;
+		});
+	}
+
+	// Headers and directories.
+	for(const char* kindName : { "plain", "encrypted" }){
+		const std::string kind(kindName);
+		const fs::path path = dataDir / (kind + ".m3a");
+		FILE* file = fopen(path.c_str(), "rb");
+		FILE* outFile = tmpfile();
+		if(!file || !outFile){
+			std::cout << "Could not open " << path << std::endl;
+			if(file){
+				fclose(file);
+			}
+			if(outFile){
+				fclose(outFile);
+			}
+			return false;
+		}
+		Directory directory;
+		readDirectory(file, directory, false, false);
+		const uint64_t headerBytes = directory.size * sizeof(uint32_t);
+
+		Buffer header;
+		decryptHeader(file, header);
+		if(kind == "encrypted"){
+			benchmarks.run("header/decrypt", headerBytes, [file](){
+				Buffer buffer;
+				decryptHeader(file, buffer);
+				benchmarkSink += buffer.data.size();
+			});
+			benchmarks.run("header/encrypt", headerBytes, [&header, outFile](){
+				encryptHeader(header, outFile);
+				benchmarkSink += header.cursor;
+			});
+		}
+		benchmarks.run("directory/read/" + kind, headerBytes, [file](){
+			Directory result;
+			readDirectory(file, result, false, false);
+			benchmarkSink += result.entries.size();
+		});
+		benchmarks.run("directory/write/" + kind, headerBytes, [&directory, outFile](){
+			fseek(outFile, 0, SEEK_SET);
+			writeDirectory(directory, outFile);
+			benchmarkSink += ftell(outFile);
+		});
+
+		// The flat directory must write the same header back.
+		FlatDirectory flatDirectory;
+		readFlatDirectory(file, flatDirectory, false);
+		const std::vector<unsigned char> written = writtenBytes([&directory](FILE* file){ writeDirectory(directory, file); });
+		const std::vector<unsigned char> flatHeader = writtenBytes([&flatDirectory](FILE* file){ writeFlatDirectory(flatDirectory, file); });
+		if(written.empty() || written != flatHeader){
+			std::cout << "Flat directory doesn't round-trip for " << path << std::endl;
+			fclose(file);
+			fclose(outFile);
+			return false;
+		}
+		benchmarks.run("directory/read-flat/" + kind, headerBytes, [file](){
+			FlatDirectory result;
+			readFlatDirectory(file, result, false);
+			benchmarkSink += result.subEntryCount();
+		});
+		benchmarks.run("directory/write-flat/" + kind, headerBytes, [&flatDirectory, outFile](){
+			fseek(outFile, 0, SEEK_SET);
+			writeFlatDirectory(flatDirectory, outFile);
+			benchmarkSink += ftell(outFile);
+		});
+		fclose(file);
+		fclose(outFile);
+	}
+
+	// Images, with the packer settings.
+	FILE* file = fopen((dataDir / "faces.m3a").c_str(), "rb");
+	if(!file){
+		std::cout << "Could not open " << (dataDir / "faces.m3a") << std::endl;
+		return false;
+	}
+	Directory directory;
+	readDirectory(file, directory, false);
+	fclose(file);
+	std::vector<unsigned char> fileData;
+	readFile(dataDir / "faces.m3a", fileData);
+	const SubEntry& face = directory.entries[0].subEntries[0];
+	const std::vector<unsigned char> source(fileData.begin() + face.offset, fileData.begin() + face.offset + face.size);
+
+	int w, h, c;
+	stbi_uc* decoded = stbi_load_from_memory(source.data(), source.size(), &w, &h, &c, kImageChannels);
+	if(!decoded){
+		std::cout << "Unable to decode JPEG file" << std::endl;
+		return false;
+	}
+	benchmarks.run("jpeg/decode", source.size(), [&source](){
+		int iw, ih, ic;
+		stbi_uc* image = stbi_load_from_memory(source.data(), source.size(), &iw, &ih, &ic, kImageChannels);
+		benchmarkSink += image[0];
+		stbi_image_free(image);
+	});
+
+	const int tgtWidth = UPSCALE_FACTOR * w;
+	const int tgtHeight = UPSCALE_FACTOR * h;
+	const uint64_t upscaledBytes = uint64_t(tgtWidth) * tgtHeight * kImageChannels;
+	std::vector<unsigned char> upscaled(upscaledBytes);
+	benchmarks.run("resize/full", upscaledBytes, [&](){
+		stbir_resize_uint8(decoded, w, h, 0, upscaled.data(), tgtWidth, tgtHeight, 0, kImageChannels);
+		benchmarkSink += upscaled[0];
+	});
+	// Same as the packer: bands of rows, on one thread here.
+	benchmarks.run("resize/bands", upscaledBytes, [&](){
+		for(int y0 = 0; y0 < tgtHeight; y0 += kResizeBandRows){
+			const int y1 = std::min(tgtHeight, y0 + int(kResizeBandRows));
+			stbir_resize_subpixel(decoded, w, h, 0, upscaled.data() + size_t(y0) * tgtWidth * kImageChannels, tgtWidth, y1 - y0, 0,
+				STBIR_TYPE_UINT8, kImageChannels, STBIR_ALPHA_CHANNEL_NONE, 0, STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT,
+				STBIR_COLORSPACE_LINEAR, nullptr, float(UPSCALE_FACTOR), float(UPSCALE_FACTOR), 0.0f, float(y0));
+		}
+		benchmarkSink += upscaled[0];
+	});
+	// Pixel replication, used by the packer when SMOOTH_RESIZE is disabled.
+	benchmarks.run("resize/nearest", upscaledBytes, [&](){
+		for(int y = 0; y < tgtHeight; ++y){
+			const unsigned char* srcRow = decoded + size_t(y / UPSCALE_FACTOR) * w * kImageChannels;
+			unsigned char* dstRow = upscaled.data() + size_t(y) * tgtWidth * kImageChannels;
+			for(int x = 0; x < tgtWidth; ++x){
+				memcpy(dstRow + x * kImageChannels, srcRow + (x / UPSCALE_FACTOR) * kImageChannels, kImageChannels);
+			}
+		}
+		benchmarkSink += upscaled[0];
+	});
+
+	stbir_resize_uint8(decoded, w, h, 0, upscaled.data(), tgtWidth, tgtHeight, 0, kImageChannels);
+	benchmarks.run("jpeg/encode", upscaledBytes, [&](){
+		std::vector<unsigned char> data;
+		stbi_write_jpg_to_func(writeJPEGToEntryFunc, (void*)&data, tgtWidth, tgtHeight, kImageChannels, upscaled.data(), 100 /* max quality */);
+		benchmarkSink += data.size();
+	});
+	stbi_image_free(decoded);
+	return true;
+}
+
+struct PackSize {
+	std::string name;
+	unsigned int archives;
+	unsigned int entries;
+	unsigned int cubeSize;
+};
+
+// Complete runs of the packer, without upscaled images so that all images go through the resize path.
+// Returns false if the packer failed or produced different outputs.
+bool runPackBenchmarks(Benchmarks& benchmarks, const BenchmarkSettings& settings){
+	std::vector<PackSize> sizes = { { "small", 1, 2, 128 } };
+	if(!settings.quick){
+		sizes.push_back({ "medium", 4, 4, 256 });
+		sizes.push_back({ "large", 8, 8, 256 });
+	}
+	for(const PackSize& size : sizes){
+		bool needed = false;
+		for(unsigned int threads : settings.threads){
+			needed = needed || benchmarks.selected("pack/" + size.name + "/threads-" + std::to_string(threads));
+		}
+		for(unsigned int shards : { 2u, 4u }){
+			needed = needed || benchmarks.selected("pack/" + size.name + "/shards-" + std::to_string(shards));
+		}
+		if(!needed){
+			continue;
+		}
+		const fs::path inputDir = settings.workDir / ("pack-" + size.name) / "in";
+		const fs::path upscaledDir = settings.workDir / ("pack-" + size.name) / "upscaled";
+		const fs::path outputDir = settings.workDir / ("pack-" + size.name) / "out";
+		uint64_t inputBytes = 0;
+		for(unsigned int a = 0; a < size.archives; ++a){
+			const fs::path archivePath = inputDir / "data" / ("node" + std::to_string(a) + ".m3a");
+			if(!runProcess({ settings.generatorPath.string(), archivePath.string(), "-seed", std::to_string(a), "-entries", std::to_string(size.entries),
+				"-cube-size", std::to_string(size.cubeSize), "-frames", "1", "-frame-size", std::to_string(size.cubeSize) })){
+				std::cout << "Could not generate " << archivePath << std::endl;
+				return false;
+			}
+			inputBytes += fs::file_size(archivePath);
+		}
+
+		for(unsigned int threads : settings.threads){
+			const std::string name = "pack/" + size.name + "/threads-" + std::to_string(threads);
+			if(!benchmarks.selected(name)){
+				continue;
+			}
+			std::vector<double> samples;
+			const unsigned int sampleCount = settings.quick ? 1 : 3;
+			for(unsigned int s = 0; s < sampleCount; ++s){
+				fs::remove_all(outputDir);
+				const auto start = std::chrono::steady_clock::now();
+				const bool success = runProcess({ settings.packerPath.string(), inputDir.string(), upscaledDir.string(), outputDir.string(),
+					(inputDir / "data").string(), "-threads", std::to_string(threads) });
+				samples.push_back(elapsedNs(start));
+				if(!success){
+					std::cout << "Packer failed for " << name << std::endl;
+					return false;
+				}
+			}
+			benchmarks.record(name, 1, inputBytes, samples);
+		}
+
+		// The same work split between concurrent processes, one per shard, which must produce the output of a single process.
+		const unsigned int maxThreads = settings.threads.back();
+		for(unsigned int shards : { 2u, 4u }){
+			const std::string name = "pack/" + size.name + "/shards-" + std::to_string(shards);
+			if(!benchmarks.selected(name)){
+				continue;
+			}
+			if(!fs::exists(outputDir) && !runProcess({ settings.packerPath.string(), inputDir.string(), upscaledDir.string(), outputDir.string(),
+				(inputDir / "data").string(), "-threads", std::to_string(maxThreads) })){
+				std::cout << "Packer failed for " << name << std::endl;
+				return false;
+			}
+			const fs::path shardOutputDir = settings.workDir / ("pack-" + size.name) / "out-shards";
+			std::vector<double> samples;
+			const unsigned int sampleCount = settings.quick ? 1 : 3;
+			for(unsigned int s = 0; s < sampleCount; ++s){
+				fs::remove_all(shardOutputDir);
+				const auto start = std::chrono::steady_clock::now();
+				std::vector<pid_t> pids;
+				bool success = true;
+				for(unsigned int shard = 0; shard < shards; ++shard){
+					pid_t pid;
+					if(!spawnProcess({ settings.packerPath.string(), inputDir.string(), upscaledDir.string(), shardOutputDir.string(), (inputDir / "data").string(),
+						"-threads", std::to_string(std::max(1u, maxThreads / shards)), "-shard", std::to_string(shard) + "/" + std::to_string(shards) }, pid)){
+						success = false;
+						break;
+					}
+					pids.push_back(pid);
+				}
+				for(pid_t pid : pids){
+					success = waitProcess(pid) && success;
+				}
+				samples.push_back(elapsedNs(start));
+				if(!success){
+					std::cout << "Packer failed for " << name << std::endl;
+					return false;
+				}
+				if(!sameDirectories(outputDir, shardOutputDir)){
+					std::cout << "Sharded output differs from a single run for " << name << std::endl;
+					return false;
+				}
+			}
+			benchmarks.record(name, 1, inputBytes, samples);
+		}
+	}
+	return true;
+}
+
+void writeResults(const std::vector<BenchmarkResult>& results, std::ostream& stream){
+	stream << "{" << "\n";
+	stream << "\t\"version\": " << BENCHMARK_VERSION << "," << "\n";
+	stream << "\t\"results\": [" << "\n";
+	for(size_t i = 0; i < results.size(); ++i){
+		const BenchmarkResult& result = results[i];
+		stream << "\t\t{ \"name\": \"" << result.name << "\", \"median_ns\": " << uint64_t(result.medianNs) << ", \"min_ns\": " << uint64_t(result.minNs)
+			<< ", \"iterations\": " << result.iterations << ", \"bytes\": " << result.bytes << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	stream << "\t]" << "\n";
+	stream << "}" << std::endl;
+}
+
+// Only parses files written by writeResults, one result per line.
+bool readResults(const fs::path& path, std::map<std::string, double>& medians){
+	std::ifstream file(path);
+	if(!file){
+		return false;
+	}
+	const std::string nameKey = "\"name\": \"";
+	const std::string medianKey = "\"median_ns\": ";
+	std::string line;
+	while(std::getline(file, line)){
+		const size_t namePos = line.find(nameKey);
+		const size_t medianPos = line.find(medianKey);
+		if(namePos == std::string::npos || medianPos == std::string::npos){
+			continue;
+		}
+		const size_t nameStart = namePos + nameKey.size();
+		const std::string name = line.substr(nameStart, line.find('"', nameStart) - nameStart);
+		medians[name] = std::stod(line.substr(medianPos + medianKey.size()));
+	}
+	return true;
+}
+
+// Counts the regressions. Returns false if the baseline can't be read or has selected benchmarks missing from this run.
+bool compareResults(const Benchmarks& benchmarks, const fs::path& baselinePath, double threshold, unsigned int& regressions){
+	std::map<std::string, double> baseline;
+	if(!readResults(baselinePath, baseline)){
+		std::cout << "Could not read baseline at path " << baselinePath << std::endl;
+		return false;
+	}
+	std::cout << "Comparison with " << baselinePath << ", threshold " << threshold << "%:" << std::endl;
+	const std::vector<BenchmarkResult>& results = benchmarks.results;
+	bool complete = true;
+	for(const auto& reference : baseline){
+		const bool found = std::any_of(results.begin(), results.end(), [&reference](const BenchmarkResult& result){ return result.name == reference.first; });
+		if(!found && benchmarks.selected(reference.first)){
+			std::cout << "\t* " << reference.first << ": missing from this run" << std::endl;
+			complete = false;
+		}
+	}
+	regressions = 0;
+	for(const BenchmarkResult& result : results){
+		auto reference = baseline.find(result.name);
+		if(reference == baseline.end() || reference->second <= 0.0){
+			std::cout << "\t* " << result.name << ": no baseline" << std::endl;
+			continue;
+		}
+		const double change = (result.medianNs / reference->second - 1.0) * 100.0;
+		const bool regressed = change > threshold;
+		regressions += regressed ? 1 : 0;
+		std::cout << "\t* " << result.name << ": " << (change >= 0.0 ? "+" : "") << change << "%" << (regressed ? " REGRESSION" : "") << std::endl;
+	}
+	return complete;
+}
+
+int main(int argc, char** argv){
+
+	BenchmarkSettings settings;
+	// By default, the other tools are next to the benchmark executable.
+	const fs::path binDir = fs::path(argv[0]).parent_path();
+	settings.generatorPath = binDir / "M3ArchiveGenerator";
+	settings.packerPath = binDir / "M3PackPatcher";
+	settings.workDir = fs::temp_directory_path() / "m3pack-benchmark";
+	settings.threads = { 1, 2, std::max(1u, std::thread::hardware_concurrency()) };
+
+	for(int i = 1; i < argc; ++i){
+		std::string arg(argv[i]);
+		// Also accept double dash options.
+		if(arg.compare(0, 2, "--") == 0){
+			arg.erase(0, 1);
+		}
+		const bool hasValue = i + 1 < argc;
+		if(arg == "-quick"){
+			settings.quick = true;
+		} else if(arg == "-generator" && hasValue){
+			settings.generatorPath = argv[++i];
+		} else if(arg == "-packer" && hasValue){
+			settings.packerPath = argv[++i];
+		} else if(arg == "-work-dir" && hasValue){
+			settings.workDir = argv[++i];
+		} else if(arg == "-output" && hasValue){
+			settings.outputPath = argv[++i];
+		} else if(arg == "-baseline" && hasValue){
+			settings.baselinePath = argv[++i];
+		} else if(arg == "-threshold" && hasValue){
+			settings.threshold = std::stod(argv[++i]);
+		} else if(arg == "-filter" && hasValue){
+			settings.filter = argv[++i];
+		} else if(arg == "-threads" && hasValue){
+			// List of thread counts for complete runs.
+			settings.threads.clear();
+			std::istringstream list(argv[++i]);
+			std::string count;
+			while(std::getline(list, count, ',')){
+				settings.threads.push_back(std::max(1ul, std::stoul(count)));
+			}
+		} else {
+			std::cout << "executable [-quick] [-filter name] [-threads N,N,...] [-generator path/to/M3ArchiveGenerator] [-packer path/to/M3PackPatcher] [-work-dir path/to/dir] [-output path/to/results.json] [-baseline path/to/baseline.json] [-threshold percents]" << std::endl;
+			return 0;
+		}
+	}
+	std::sort(settings.threads.begin(), settings.threads.end());
+	settings.threads.erase(std::unique(settings.threads.begin(), settings.threads.end()), settings.threads.end());
+	if(settings.quick){
+		settings.samples = 3;
+		settings.sampleTime = 0.01;
+	}
+
+	fs::remove_all(settings.workDir);
+	if(!generateMicroData(settings)){
+		std::cout << "Could not generate archives with " << settings.generatorPath << std::endl;
+		return -1;
+	}
+
+	Benchmarks benchmarks(settings);
+	bool success = runMicroBenchmarks(benchmarks, settings);
+	success = runPackBenchmarks(benchmarks, settings) && success;
+	fs::remove_all(settings.workDir);
+
+	if(!settings.outputPath.empty()){
+		std::ofstream outFile(settings.outputPath);
+		writeResults(benchmarks.results, outFile);
+		std::cout << "Results written to " << settings.outputPath << std::endl;
+	}
+	if(!success){
+		std::cout << "Some benchmarks failed." << std::endl;
+		return -1;
+	}
+	if(!settings.baselinePath.empty()){
+		unsigned int regressions = 0;
+		if(!compareResults(benchmarks, settings.baselinePath, settings.threshold, regressions)){
+			return -1;
+		}
+		if(regressions != 0){
+			std::cout << regressions << " benchmark(s) regressed by more than " << settings.threshold << "%." << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
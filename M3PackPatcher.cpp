@@ -1,10 +1,49 @@
 #include <iostream>
 #include <cstdio>
+#include <cerrno>
+#include <cctype>
+#include <climits>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <map>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <list>
+#include <chrono>
+#include <functional>
+#include <tuple>
+#include <cmath>
+#include <condition_variable>
+
+#include <csignal>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include "libs/filesystem.hpp"
+#include "AsyncIO.hpp"
+#include "TaskScheduler.hpp"
+#include "M3Archive.hpp"
+#include "ArchiveReader.hpp"
+#include "ArchiveCatalog.hpp"
+#include "Trace.hpp"
+#include "MemoryTracker.hpp"
+#include "Log.hpp"
+#include "LocalSocket.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
@@ -12,554 +51,3634 @@
 
 #define STBI_ONLY_JPEG
 
+// Route image allocations through the memory accounting.
+#define STBI_MALLOC(size) trackedMalloc(size, kMemoryDecode)
+#define STBI_REALLOC(ptr, size) trackedRealloc(ptr, size, kMemoryDecode)
+#define STBI_FREE(ptr) trackedFree(ptr)
+#define STBIR_MALLOC(size, context) trackedMalloc(size, kMemoryResize)
+#define STBIR_FREE(ptr, context) trackedFree(ptr)
+#define STBIW_MALLOC(size) trackedMalloc(size, kMemoryEncode)
+#define STBIW_REALLOC(ptr, size) trackedRealloc(ptr, size, kMemoryEncode)
+#define STBIW_FREE(ptr) trackedFree(ptr)
+
 #include "libs/stb_image.h"
 #include "libs/stb_image_resize.h"
 #include "libs/stb_image_write.h"
 
 namespace fs = ghc::filesystem;
 
-#define UPSCALE_FACTOR 4
-
-enum ResourceType {
-		kCubeFace           =  0,
-		kWaterEffectMask    =  1,
-		kLavaEffectMask     =  2,
-		kMagneticEffectMask =  3,
-		kShieldEffectMask   =  4,
-		kSpotItem           =  5,
-		kFrame              =  6,
-		kRawData            =  7,
-		kMovie              =  8,
-		kStillMovie         = 10,
-		kText               = 11,
-		kTextMetadata       = 12,
-		kNumMetadata        = 13,
-		kLocalizedSpotItem  = 69,
-		kLocalizedFrame     = 70,
-		kMultitrackMovie    = 72,
-		kDialogMovie        = 74
+extern char** environ;
+
+struct UpscalerSettings {
+	std::string command;
+	unsigned int jobs{1};
+	unsigned int batch{1};
 };
 
-std::unordered_map<ResourceType, std::string> resourceNames = {
-	{ kCubeFace          , "kCubeFace" }, 
-	{ kWaterEffectMask   , "kWaterEffectMask" }, 
-	{ kLavaEffectMask    , "kLavaEffectMask" }, 
-	{ kMagneticEffectMask, "kMagneticEffectMask" }, 
-	{ kShieldEffectMask  , "kShieldEffectMask" }, 
-	{ kSpotItem          , "kSpotItem" }, 
-	{ kFrame             , "kFrame" }, 
-	{ kRawData           , "kRawData" }, 
-	{ kMovie             , "kMovie" }, 
-	{ kStillMovie        , "kStillMovie" }, 
-	{ kText              , "kText" }, 
-	{ kTextMetadata      , "kTextMetadata" }, 
-	{ kNumMetadata       , "kNumMetadata" }, 
-	{ kLocalizedSpotItem , "kLocalizedSpotItem" }, 
-	{ kLocalizedFrame    , "kLocalizedFrame" }, 
-	{ kMultitrackMovie   , "kMultitrackMovie" }, 
-	{ kDialogMovie       , "kDialogMovie" }, 
+struct UpscaleRequest {
+	fs::path input;
+	fs::path output;
+	std::vector<fs::path> copies; // for identical images elsewhere.
 };
 
-std::string getResourceTypeName(ResourceType type){
-	if(resourceNames.count(type) == 0){
-		return "Unknown";
+// The command is run through the shell, with pairs of input and output paths appended: "command in0 out0 in1 out1..."
+pid_t spawnUpscaler(const std::string& command, const std::vector<UpscaleRequest>& requests, size_t first, size_t count){
+	const std::string script = command + " \"$@\"";
+	std::vector<std::string> args = { "/bin/sh", "-c", script, "m3pack-upscaler" };
+	for(size_t i = first; i < first + count; ++i){
+		args.push_back(requests[i].input.string());
+		args.push_back(requests[i].output.string());
+	}
+	std::vector<char*> argv;
+	for(std::string& arg : args){
+		argv.push_back(&arg[0]);
+	}
+	argv.push_back(nullptr);
+
+	pid_t pid;
+	if(posix_spawn(&pid, "/bin/sh", nullptr, nullptr, argv.data(), environ) != 0){
+		return -1;
 	}
-	return resourceNames.at(type);
+	return pid;
 }
 
-struct SubEntry {
-	std::vector<uint32_t> metadata;
-	std::vector<unsigned char> data;
-	ResourceType type;
-	uint32_t offset;
-	uint32_t size;
-	unsigned char face;
+// Outputs are written by the command to temporary paths and only moved in place if it succeeds,
+// so that an interrupted invocation never leaves a truncated file in the upscaled directory.
+// The files put in the upscaled directory are listed in writtenFiles.
+void runUpscaler(const UpscalerSettings& settings, const std::vector<UpscaleRequest>& requests, std::vector<fs::path>& writtenFiles){
+	std::vector<UpscaleRequest> tmpRequests(requests);
+	for(UpscaleRequest& request : tmpRequests){
+		fs::create_directories(request.output.parent_path());
+		request.output += ".tmp.jpeg";
+	}
+
+	const size_t jobCount = std::max(settings.jobs, 1u);
+	const size_t batchSize = std::max(settings.batch, 1u);
+
+	struct Invocation {
+		size_t first;
+		size_t count;
+	};
+	std::unordered_map<pid_t, Invocation> running;
+	size_t next = 0;
+
+	while(next < tmpRequests.size() || !running.empty()){
+		// Fill the pool.
+		while(next < tmpRequests.size() && running.size() < jobCount){
+			const size_t count = std::min(batchSize, tmpRequests.size() - next);
+			const pid_t pid = spawnUpscaler(settings.command, tmpRequests, next, count);
+			if(pid < 0){
+				LOG(kLogError) << "Unable to run upscaler command: " << settings.command;
+			} else {
+				running[pid] = { next, count };
+			}
+			next += count;
+		}
+		if(running.empty()){
+			break;
+		}
+
+		int status = 0;
+		const pid_t pid = waitpid(-1, &status, 0);
+		if(pid < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		auto invocation = running.find(pid);
+		if(invocation == running.end()){
+			continue;
+		}
+		const bool success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		for(size_t i = invocation->second.first; i < invocation->second.first + invocation->second.count; ++i){
+			const fs::path& tmpPath = tmpRequests[i].output;
+			std::error_code ec;
+			if(success && fs::exists(tmpPath)){
+				fs::rename(tmpPath, requests[i].output, ec);
+				if(ec){
+					LOG(kLogError) << "Could not move upscaled image to path " << requests[i].output << ": " << ec.message();
+					fs::remove(tmpPath, ec);
+					continue;
+				}
+				writtenFiles.push_back(requests[i].output);
+				for(const fs::path& copyPath : requests[i].copies){
+					fs::create_directories(copyPath.parent_path(), ec);
+					if(!ec){
+						fs::copy_file(requests[i].output, copyPath, fs::copy_options::overwrite_existing, ec);
+					}
+					if(ec){
+						LOG(kLogError) << "Could not copy upscaled image to path " << copyPath << ": " << ec.message();
+						continue;
+					}
+					writtenFiles.push_back(copyPath);
+				}
+			} else {
+				fs::remove(tmpPath, ec);
+			}
+		}
+		if(!success){
+			LOG(kLogError) << "Upscaler command failed for " << invocation->second.count << " image(s), starting with " << requests[invocation->second.first].input.filename();
+		}
+		running.erase(invocation);
+	}
+}
+
+
+enum PipelineStage {
+	kStageRead,
+	kStageDecode,
+	kStageResize,
+	kStageEncode,
+	kStageWrite,
+	kStageCount
 };
 
-struct Entry {
-	std::vector<SubEntry> subEntries;
-	std::string name;
-	uint32_t index; // uint24_t
+const std::string stageNames[kStageCount] = { "read", "decode", "resize", "encode", "write" };
+// Time spent by jobs waiting for each stage, in traces.
+const char* const queueSpanNames[kStageCount] = { "wait read", "wait decode", "wait resize", "wait encode", "wait write" };
+
+struct PipelineSettings {
+	unsigned int workers[kStageCount] = { 1, 1, 1, 1, 1 };
+	size_t queueSize{8};
+	uint64_t maxMemory{0}; // estimated bytes used by loaded archives and jobs in flight, 0 for no limit.
 };
 
-struct Directory {
-	std::vector<Entry> entries;
-	uint32_t size;
-	bool encoded;
+struct Settings {
+	fs::path inputDir;
+	fs::path upscaledDir;
+	fs::path outputDir;
+	fs::path tracePath; // Chrome trace of the run, if not empty.
+	fs::path reportPath; // run report, or list of all results of a fidelity check, if not empty.
+	size_t outliers{20}; // least similar images listed by a fidelity check.
+	bool memoryReport{false};
+	UpscalerSettings upscaler;
+	PipelineSettings pipeline;
+	IOSettings io;
+	unsigned int threads{1};
+	unsigned int shardIndex{0}; // only process the archives of this shard, out of shardCount.
+	unsigned int shardCount{1};
+	bool expectNames{false};
+	bool passthrough{false};
+	bool shareBlobs{true};
+	bool watch{false};
+	bool updateInPlace{false};
+	bool verify{false};
+	bool incremental{false};
 };
 
-struct Buffer {
-	std::vector<unsigned char> data;
-	uint32_t cursor{0};
+struct Archive {
+	Directory directory;
+	fs::path relativeFile;
+	fs::path upscaledArchivePath;
+	std::string defaultEntryName;
+	uint32_t traceLabel{Trace::kNoLabel};
+	uint64_t fingerprint{0}; // of the inputs, 0 if not tracked.
+	MemoryCounter memory;
+	std::atomic<size_t> pendingJobs{0};
+	std::atomic<bool> dataModified{false};
+};
 
-	template<typename T>
-	T read(){
-		T val = *(reinterpret_cast<T*>(&data[cursor]));
-		cursor += sizeof(T) / sizeof(unsigned char);
-		return val;
-	}
+struct JobTarget {
+	Archive* archive;
+	SubEntry* subEntry;
+};
 
-	template<typename T>
-	void write(T val){
-		*(reinterpret_cast<T*>(&data[cursor])) = val;
-		cursor += sizeof(T) / sizeof(unsigned char);
-	}
+struct Job {
+	Archive* archive;
+	SubEntry* subEntry;
+	fs::path upscaledFilePath;
+	fs::path resumedFilePath; // result of a previous interrupted run.
+	std::shared_ptr<const std::vector<unsigned char>> cachedData; // result of a previous run in watch or daemon mode.
+	std::vector<JobTarget> duplicates; // receiving the same result.
+	uint64_t cost;
+	uint64_t memory; // estimated peak footprint while processed.
+	bool hasReplacement;
+};
+
+struct StageReport {
+	unsigned int workers{0};
+	uint64_t items{0};
+	uint64_t busyTime{0};
+	uint64_t starvedTime{0};
+	uint64_t blockedTime{0};
+	uint64_t runTime{0};
+	size_t queueCapacity{0};
+	double averageQueueSize{0.0};
+};
 
-	uint32_t readUint24_t(){
-		uint32_t value = read<uint16_t>();
-		value |= read<unsigned char>() << 16;
-		return value;
+struct RunReport {
+	size_t archives{0};
+	size_t jobs{0};
+	size_t duplicates{0};
+	size_t duplicateBytes{0};
+	size_t skippedArchives{0};
+	size_t upToDateArchives{0};
+	std::atomic<size_t> failedArchives{0}; // not written.
+	std::atomic<size_t> replaced{0};
+	std::atomic<size_t> resumed{0};
+	std::atomic<size_t> cached{0};
+	std::atomic<size_t> upscaled{0};
+	std::atomic<size_t> failed{0};
+	std::atomic<size_t> sharedBlobs{0};
+	std::atomic<size_t> sharedBytes{0};
+	std::atomic<size_t> verified{0};
+	std::atomic<size_t> verifyFailures{0};
+	std::atomic<uint64_t> verifyTime{0};
+	uint64_t peakMemory{0}; // estimated.
+	size_t memoryWaits{0};
+	StageReport stages[kStageCount];
+};
+
+// Suggest compaction when more than 1/kCompactionRatio of an archive is dead space.
+const uint64_t kCompactionRatio = 4;
+
+uint64_t elapsedNs(const std::chrono::steady_clock::time_point& start){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool readFile(const fs::path& path, std::vector<unsigned char>& data){
+	FILE* file = fopen(path.c_str(), "rb");
+	if(!file){
+		return false;
 	}
+	fseek(file, 0, SEEK_END);
+	data.resize(ftell(file));
+	fseek(file, 0L, SEEK_SET);
+	const bool success = fread(data.data(), sizeof(unsigned char), data.size(), file) == data.size();
+	fclose(file);
+	return success;
+}
+
+// Temporary path next to the given one, unique to this process and call so that concurrent writers never share it.
+fs::path makeTmpPath(const fs::path& path){
+	static std::atomic<uint64_t> counter{0};
+	return path.string() + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+}
 
-	void writeUint24_t(uint32_t val){
-		uint16_t v0 = val & 0xFFFF;
-		unsigned char v1 = (val >> 16) & 0xFF;
-		write<uint16_t>(v0);
-		write<unsigned char>(v1);
+// Flush and close a written file, its content is on disk on success.
+bool closeSyncedFile(FILE* file){
+	const bool synced = fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+	return fclose(file) == 0 && synced;
+}
+
+// Make the files renamed in a directory durable.
+bool syncDirectory(const fs::path& dir){
+	const int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0){
+		return false;
 	}
+	const bool success = fsync(fd) == 0;
+	close(fd);
+	return success;
+}
 
-	template<typename T>
-	bool contains(){
-		return cursor + sizeof(T) / sizeof(unsigned char) < data.size();
+// Parse a whole string as a decimal count no smaller than minValue.
+bool parseCount(const std::string& str, unsigned int& count, unsigned int minValue = 0){
+	if(str.empty() || !std::isdigit((unsigned char)str[0])){
+		return false;
+	}
+	char* end = nullptr;
+	errno = 0;
+	const unsigned long value = strtoul(str.c_str(), &end, 10);
+	if(errno == ERANGE || *end != '\0' || value > UINT_MAX || value < minValue){
+		return false;
 	}
+	count = (unsigned int)value;
+	return true;
+}
 
-	std::string readString(uint32_t size){
-		std::string str;
-		str.resize(size);
-		for(uint32_t i = 0; i < size; ++i){
-			str[i] = read<char>();
+// Append-only record of the work completed by a run, used to resume it after an interruption.
+// Lines are either "archive <relative path>" for archives written to the output directory,
+// or "blob <source hash> <source size> <result hash>" for upscaled images stored next to the journal.
+struct Journal {
+	std::unordered_set<std::string> archives;
+	std::unordered_map<std::string, uint64_t> blobs;
+	fs::path blobsDir;
+	FILE* file{nullptr};
+	std::mutex mutex;
+
+	~Journal(){
+		if(file){
+			fclose(file);
 		}
-		return str;
 	}
 
-	void writeString(const std::string& str, uint32_t maxSize){
-		const uint32_t charCount = std::min(uint32_t(str.size()), maxSize);
-		for(uint32_t i = 0; i < charCount; ++i){
-			write<char>(str[i]);
+	// Previous records are only kept if they were produced with the same settings.
+	bool open(const fs::path& path, const std::string& settingsKey){
+		blobsDir = path.string() + ".blobs";
+		const std::string header = "m3pack-journal " + settingsKey;
+
+		std::ifstream previous(path.string());
+		std::string line;
+		if(std::getline(previous, line) && line == header){
+			while(std::getline(previous, line)){
+				std::istringstream record(line);
+				std::string kind;
+				record >> kind;
+				if(kind == "archive"){
+					archives.insert(line.substr(kind.size() + 1));
+				} else if(kind == "blob"){
+					std::string key;
+					uint64_t resultHash = 0;
+					record >> key >> std::hex >> resultHash;
+					blobs[key] = resultHash;
+				}
+			}
+			LOG(kLogInfo) << "Resuming from journal " << path << ": " << archives.size() << " archive(s) and " << blobs.size() << " blob(s) done.";
+			file = fopen(path.c_str(), "ab");
+		} else {
+			std::error_code ec;
+			fs::remove_all(blobsDir, ec);
+			file = fopen(path.c_str(), "wb");
+			if(file){
+				append(header, false);
+			}
 		}
+		fs::create_directories(blobsDir);
+		return file != nullptr;
 	}
 
-	void resize(uint32_t sizeInBytes){
-		data.resize(sizeInBytes);
+	bool enabled() const {
+		return file != nullptr;
 	}
 
-};
+	static std::string blobKey(const SubEntry& source){
+		char key[32];
+		snprintf(key, sizeof(key), "%016llx-%u", (unsigned long long)source.hash, (unsigned int)source.data.size());
+		return key;
+	}
 
-bool decryptHeader(FILE* file, Buffer& buffer) {
-	static const uint32_t addKey = 0x3C6EF35F;
-	static const uint32_t multKey = 0x0019660D;
+	bool isArchiveDone(const fs::path& relativeFile) const {
+		return archives.count(relativeFile.generic_string()) != 0;
+	}
 
-	fseek(file, 0, SEEK_SET);
+	// Path to the stored result for a source blob, if it was completed by a previous run.
+	bool findBlob(const SubEntry& source, fs::path& path) const {
+		const std::string key = blobKey(source);
+		if(blobs.count(key) == 0){
+			return false;
+		}
+		path = blobsDir / (key + ".jpeg");
+		return fs::exists(path);
+	}
 
-	uint32_t data;
-	uint32_t size = 0;
-	fread(&size, sizeof(uint32_t), 1, file);
+	bool isValidBlob(const SubEntry& source, const std::vector<unsigned char>& result) const {
+		auto blob = blobs.find(blobKey(source));
+		return blob != blobs.end() && blob->second == hashData(result.data(), result.size());
+	}
 
-	bool encrypted = size > 1000000;
-	fseek(file, 0, SEEK_SET);
+	void recordBlob(const SubEntry& source, const std::vector<unsigned char>& result){
+		const std::string key = blobKey(source);
+		const fs::path path = blobsDir / (key + ".jpeg");
+		if(!writeFileAtomically(path, result)){
+			return;
+		}
+		char resultHash[20];
+		snprintf(resultHash, sizeof(resultHash), "%016llx", (unsigned long long)hashData(result.data(), result.size()));
+		append("blob " + key + " " + resultHash, false);
+	}
 
-	if(encrypted) {
-		uint32_t decryptedSize = size ^ addKey;
-		buffer.resize(decryptedSize * sizeof(uint32_t));
+	void recordArchive(const fs::path& relativeFile){
+		append("archive " + relativeFile.generic_string(), true);
+	}
 
-		uint32_t currentKey = 0;
-		for (uint32_t i = 0; i < decryptedSize; ++i) {
-			currentKey += addKey;
-			fread(&data, sizeof(uint32_t), 1, file);
-			buffer.write<uint32_t>(data ^ currentKey);
-			currentKey *= multKey;
+	void append(const std::string& line, bool sync){
+		std::lock_guard<std::mutex> lock(mutex);
+		fputs((line + "\n").c_str(), file);
+		fflush(file);
+		if(sync){
+			fdatasync(fileno(file));
 		}
-	} else {
-		buffer.resize(size * sizeof(uint32_t));
-		fread(buffer.data.data(), sizeof(uint32_t), size, file);
 	}
-	buffer.cursor = 0;
-	return encrypted;
-}
-
-void encryptHeader(Buffer& buffer, FILE* file) {
-	static const uint32_t addKey = 0x3C6EF35F;
-	static const uint32_t multKey = 0x0019660D;
 
-	fseek(file, 0, SEEK_SET);
-	buffer.cursor = 0;
+	// Combine the journals of runs on separate shards, along with their stored blobs.
+	// All journals must have been produced with the same settings.
+	static bool merge(const fs::path& path, const std::vector<fs::path>& shardPaths){
+		const fs::path mergedBlobsDir = path.string() + ".blobs";
+		fs::create_directories(mergedBlobsDir);
+		std::string header;
+		std::string content;
+		std::unordered_set<std::string> records;
+		for(const fs::path& shardPath : shardPaths){
+			std::ifstream shard(shardPath.string());
+			std::string line;
+			if(!std::getline(shard, line) || (!header.empty() && line != header)){
+				LOG(kLogError) << "Journal " << shardPath << " was produced with different settings";
+				return false;
+			}
+			if(header.empty()){
+				header = line;
+				content = header + "\n";
+			}
+			const fs::path shardBlobsDir = shardPath.string() + ".blobs";
+			while(std::getline(shard, line)){
+				if(records.count(line) != 0){
+					continue;
+				}
+				std::istringstream record(line);
+				std::string kind, key;
+				record >> kind >> key;
+				if(kind == "blob"){
+					// Only keep blobs whose result is present.
+					std::error_code ec;
+					const fs::path blobPath = key + ".jpeg";
+					fs::copy_file(shardBlobsDir / blobPath, mergedBlobsDir / blobPath, fs::copy_options::skip_existing, ec);
+					if(!fs::exists(mergedBlobsDir / blobPath)){
+						continue;
+					}
+				} else if(kind != "archive"){
+					continue;
+				}
+				records.insert(line);
+				content += line + "\n";
+			}
+		}
+		LOG(kLogInfo) << "Merged " << shardPaths.size() << " journal(s), " << records.size() << " record(s).";
+		return writeFileAtomically(path, (const unsigned char*)content.data(), content.size());
+	}
 
-	// 34e35882		// 512a91e7
-	// e7d60f6e		// 8c00d905
-	uint32_t size = buffer.data.size() / sizeof(uint32_t);
+	// Write to a temporary file then move it in place, so that readers never see a partial file
+	// and a crash leaves either the previous or the new file on disk.
+	static bool writeFileAtomically(const fs::path& path, const std::vector<unsigned char>& data){
+		return writeFileAtomically(path, data.data(), data.size());
+	}
 
-	uint32_t currentKey = 0;
-	for (uint32_t i = 0; i < size; ++i) {
-		currentKey += addKey;
-		uint32_t data = buffer.read<uint32_t>() ^ currentKey;
-		fwrite(&data, sizeof(uint32_t), 1, file);
-		currentKey *= multKey;
+	static bool writeFileAtomically(const fs::path& path, const unsigned char* data, size_t size){
+		const fs::path tmpPath = makeTmpPath(path);
+		FILE* tmpFile = fopen(tmpPath.c_str(), "wb");
+		if(!tmpFile){
+			return false;
+		}
+		const bool written = fwrite(data, sizeof(unsigned char), size, tmpFile) == size;
+		const bool success = closeSyncedFile(tmpFile) && written;
+		std::error_code ec;
+		if(success){
+			fs::rename(tmpPath, path, ec);
+		}
+		if(!success || ec){
+			fs::remove(tmpPath, ec);
+			return false;
+		}
+		return syncDirectory(path.parent_path());
 	}
-}
+};
 
-void readSubEntry(Buffer &buffer, SubEntry& subEntry) {
-	
-	subEntry.offset = buffer.read<uint32_t>();
+// Upscaled blobs kept in memory between runs in watch and daemon modes, indexed by source data.
+// The least recently used blobs are evicted above maxBytes.
+struct BlobCache {
+	typedef std::shared_ptr<const std::vector<unsigned char>> Blob;
+	typedef std::list<std::pair<std::string, Blob>> BlobList;
+
+	BlobList blobs; // most recently used first.
+	std::unordered_map<std::string, BlobList::iterator> index;
+	uint64_t bytes{0};
+	uint64_t maxBytes{256ull << 20};
+	std::mutex mutex;
+	bool enabled{false};
+
+	// The returned data stays valid even if it is evicted.
+	Blob find(const SubEntry& source){
+		std::lock_guard<std::mutex> lock(mutex);
+		auto blob = index.find(Journal::blobKey(source));
+		if(blob == index.end()){
+			return nullptr;
+		}
+		blobs.splice(blobs.begin(), blobs, blob->second);
+		return blob->second->second;
+	}
 
-	subEntry.size = buffer.read<uint32_t>();
-	uint16_t metadataSize = buffer.read<uint16_t>();
+	void store(const SubEntry& source, const std::vector<unsigned char>& result){
+		if(result.size() > maxBytes){
+			return;
+		}
+		const std::string key = Journal::blobKey(source);
+		std::lock_guard<std::mutex> lock(mutex);
+		if(index.count(key) != 0){
+			return;
+		}
+		blobs.emplace_front(key, std::make_shared<const std::vector<unsigned char>>(result));
+		index[key] = blobs.begin();
+		bytes += result.size();
+		while(bytes > maxBytes){
+			bytes -= blobs.back().second->size();
+			index.erase(blobs.back().first);
+			blobs.pop_back();
+		}
+	}
+};
 
-	subEntry.face = buffer.read<unsigned char>();
-	subEntry.type = (ResourceType)buffer.read<unsigned char>();
+// Fingerprints of the inputs of each output archive, to skip archives whose inputs are unchanged since they
+// were written, the way make skips up-to-date targets. A fingerprint combines the packer settings, the hash of
+// the input archive, and the name, size, modification time and hash of each edited image found for it.
+// Hashes of files are reused as long as their size and modification time are the same, so that checking
+// an up-to-date archive only lists and stats files.
+// Lines are either "file <size> <time> <hash> <path>" or "archive <fingerprint> <output size> <output time> <relative path>".
+struct Fingerprints {
+	struct FileRecord {
+		uint64_t size;
+		int64_t time; // in nanoseconds.
+		uint64_t hash;
+	};
+	struct ArchiveRecord {
+		uint64_t fingerprint;
+		uint64_t outputSize;
+		int64_t outputTime;
+	};
+
+	fs::path path;
+	std::string settingsKey;
+	std::unordered_map<std::string, FileRecord> previousFiles;
+	std::unordered_map<std::string, FileRecord> files; // seen by this run.
+	std::unordered_map<std::string, ArchiveRecord> archives;
+	std::mutex mutex;
+	bool enabled{false};
+
+	static const char* header(){
+		return "m3pack-fingerprints 1";
+	}
 
-	// Metadata blocks are using size and offset fields to store metadata.
-	if(subEntry.type != kNumMetadata && subEntry.type != kTextMetadata){
-		subEntry.data.resize(subEntry.size);
+	// Records are read from the shared file then from the file of this run, written on save.
+	// They only differ for runs on a shard, whose files are combined with -merge.
+	bool open(const fs::path& filePath, const fs::path& sharedPath, const std::string& key){
+		path = filePath;
+		settingsKey = key;
+		enabled = true;
+		return (sharedPath == path || load(sharedPath)) && load(path);
 	}
-	subEntry.metadata.resize(metadataSize);
 
-	for (uint i = 0; i < metadataSize; ++i) {
-		subEntry.metadata[i] = buffer.read<uint32_t>();
+	// A missing file is valid.
+	bool load(const fs::path& filePath){
+		std::ifstream file(filePath.string());
+		std::string line;
+		if(!std::getline(file, line)){
+			return true;
+		}
+		if(line != header()){
+			return false;
+		}
+		while(std::getline(file, line)){
+			std::istringstream record(line);
+			std::string kind;
+			record >> kind;
+			if(kind == "file"){
+				FileRecord item;
+				record >> item.size >> item.time >> std::hex >> item.hash;
+				record.get();
+				std::string itemPath;
+				std::getline(record, itemPath);
+				previousFiles[itemPath] = item;
+			} else if(kind == "archive"){
+				ArchiveRecord item;
+				record >> std::hex >> item.fingerprint >> std::dec >> item.outputSize >> item.outputTime;
+				record.get();
+				std::string relativeFile;
+				std::getline(record, relativeFile);
+				archives[relativeFile] = item;
+			}
+		}
+		return true;
 	}
 
-}
+	static bool statFile(const fs::path& filePath, uint64_t& size, int64_t& time){
+		struct stat fileStat;
+		if(::stat(filePath.c_str(), &fileStat) != 0 || !S_ISREG(fileStat.st_mode)){
+			return false;
+		}
+		size = fileStat.st_size;
+		time = int64_t(fileStat.st_mtim.tv_sec) * 1000000000 + fileStat.st_mtim.tv_nsec;
+		return true;
+	}
 
-void readEntry(Buffer &buffer, Entry& entry, bool expectNames) {
-		
-	if(expectNames){
-		entry.name = buffer.readString(4);
+	static bool hashFile(const fs::path& filePath, uint64_t size, uint64_t& hash){
+		if(size == 0){
+			hash = hashData(nullptr, 0);
+			return true;
+		}
+		const int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+		void* mapping = fd < 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if(fd >= 0){
+			close(fd);
+		}
+		if(mapping == MAP_FAILED){
+			return false;
+		}
+		hash = hashData((const unsigned char*)mapping, size);
+		munmap(mapping, size);
+		return true;
 	}
-	
-	entry.index = buffer.readUint24_t();
 
-	unsigned char subItemCount = buffer.read<unsigned char>();
-		
-	entry.subEntries.resize(subItemCount);
+	// Append the size, time and hash of a file to the key, reusing its previous hash if it looks unchanged.
+	bool appendFile(const fs::path& filePath, std::string& key){
+		FileRecord item;
+		if(!statFile(filePath, item.size, item.time)){
+			return false;
+		}
+		const std::string pathKey = filePath.generic_string();
+		bool known = false;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto previous = previousFiles.find(pathKey);
+			known = previous != previousFiles.end() && previous->second.size == item.size && previous->second.time == item.time;
+			if(known){
+				item.hash = previous->second.hash;
+			}
+		}
+		if(!known && !hashFile(filePath, item.size, item.hash)){
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			files[pathKey] = item;
+		}
+		char values[64];
+		snprintf(values, sizeof(values), " %llu %lld %016llx", (unsigned long long)item.size, (long long)item.time, (unsigned long long)item.hash);
+		key += values;
+		return true;
+	}
 
-	for (uint i = 0; i < subItemCount; i++) {
-		readSubEntry(buffer, entry.subEntries[i]);
+	// Fingerprint of the inputs of an archive, or 0 if they can't be read.
+	uint64_t compute(const fs::path& inputPath, const fs::path& upscaledArchivePath){
+		std::string key = settingsKey + "\ninput";
+		if(!appendFile(inputPath, key)){
+			return 0;
+		}
+		std::vector<fs::path> editPaths;
+		const std::string editSuffix = "-edit.jpeg";
+		std::error_code ec;
+		for(fs::directory_iterator item(upscaledArchivePath, ec), end; !ec && item != end; item.increment(ec)){
+			const std::string name = item->path().filename().string();
+			if(name.size() > editSuffix.size() && name.compare(name.size() - editSuffix.size(), editSuffix.size(), editSuffix) == 0){
+				editPaths.push_back(item->path());
+			}
+		}
+		std::sort(editPaths.begin(), editPaths.end());
+		for(const fs::path& editPath : editPaths){
+			key += "\n" + editPath.filename().string();
+			if(!appendFile(editPath, key)){
+				return 0;
+			}
+		}
+		const uint64_t fingerprint = hashData((const unsigned char*)key.data(), key.size());
+		return fingerprint == 0 ? 1 : fingerprint;
 	}
 
-}
+	static bool isRecordedOutput(const ArchiveRecord& record, const fs::path& outputPath){
+		uint64_t size = 0;
+		int64_t time = 0;
+		return statFile(outputPath, size, time) && record.outputSize == size && record.outputTime == time;
+	}
 
-void readDirectory(FILE* file, Directory& directory, bool expectNames) {
-	Buffer buffer;
+	// The output must also be the file written when the fingerprint was recorded.
+	bool isUpToDate(const fs::path& relativeFile, uint64_t fingerprint, const fs::path& outputPath){
+		auto record = archives.find(relativeFile.generic_string());
+		return fingerprint != 0 && record != archives.end() && record->second.fingerprint == fingerprint
+			&& isRecordedOutput(record->second, outputPath);
+	}
 
-	directory.encoded = decryptHeader(file, buffer);
-	directory.size = buffer.read<uint32_t>();
-	assert(directory.size * sizeof(uint32_t) == buffer.data.size());
-	while(buffer.contains<uint32_t>()) {
-		directory.entries.emplace_back();
-		readEntry(buffer, directory.entries.back(), expectNames);
+	void record(const fs::path& relativeFile, uint64_t fingerprint, const fs::path& outputPath){
+		ArchiveRecord item;
+		if(!enabled || fingerprint == 0 || !statFile(outputPath, item.outputSize, item.outputTime)){
+			return;
+		}
+		item.fingerprint = fingerprint;
+		std::lock_guard<std::mutex> lock(mutex);
+		archives[relativeFile.generic_string()] = item;
 	}
-}
 
+	// Files not seen by this run are kept while they exist, for runs on other archives.
+	bool save(){
+		std::string content = std::string(header()) + "\n";
+		char values[96];
+		auto appendFileRecord = [&](const std::string& filePath, const FileRecord& item){
+			snprintf(values, sizeof(values), "file %llu %lld %016llx ", (unsigned long long)item.size, (long long)item.time, (unsigned long long)item.hash);
+			content += values + filePath + "\n";
+		};
+		for(const auto& item : files){
+			appendFileRecord(item.first, item.second);
+		}
+		for(const auto& item : previousFiles){
+			if(files.count(item.first) == 0 && fs::exists(item.first)){
+				appendFileRecord(item.first, item.second);
+			}
+		}
+		for(const auto& item : archives){
+			snprintf(values, sizeof(values), "archive %016llx %llu %lld ", (unsigned long long)item.second.fingerprint, (unsigned long long)item.second.outputSize, (long long)item.second.outputTime);
+			content += values + item.first + "\n";
+		}
+		return Journal::writeFileAtomically(path, (const unsigned char*)content.data(), content.size());
+	}
 
-void writeSubEntry(const SubEntry& subEntry, Buffer &buffer) {
-	
-	buffer.write<uint32_t>(subEntry.offset);
+	// Combine the fingerprints of runs on separate shards, next to their output directory. An archive recorded
+	// in several files keeps the record matching its current output, the others are stale.
+	static bool merge(const fs::path& path, const std::vector<fs::path>& shardPaths){
+		Fingerprints merged;
+		merged.path = path;
+		const fs::path outputDir = path.parent_path();
+		for(const fs::path& shardPath : shardPaths){
+			Fingerprints shard;
+			if(!shard.load(shardPath)){
+				LOG(kLogError) << "Fingerprints " << shardPath << " were produced by another version";
+				return false;
+			}
+			for(const auto& item : shard.previousFiles){
+				merged.files[item.first] = item.second;
+			}
+			for(const auto& item : shard.archives){
+				if(merged.archives.count(item.first) == 0 || isRecordedOutput(item.second, outputDir / item.first)){
+					merged.archives[item.first] = item.second;
+				}
+			}
+		}
+		LOG(kLogInfo) << "Merged " << shardPaths.size() << " fingerprint file(s), " << merged.archives.size() << " archive(s).";
+		return merged.save();
+	}
+};
 
-	buffer.write<uint32_t>(subEntry.size);
-	buffer.write<uint16_t>(subEntry.metadata.size());
+// Files written by the packer in the upscaled directory, whose changes don't trigger a repack in watch mode.
+// A file is only ignored as long as its size and modification time are the recorded ones.
+struct OwnWrites {
+	std::unordered_map<std::string, std::pair<uint64_t, int64_t>> files;
 
-	buffer.write<unsigned char>(subEntry.face);
-	buffer.write<unsigned char>(subEntry.type);
+	void record(const std::vector<fs::path>& paths){
+		for(const fs::path& path : paths){
+			std::pair<uint64_t, int64_t> stat;
+			if(Fingerprints::statFile(path, stat.first, stat.second)){
+				files[path.lexically_normal().generic_string()] = stat;
+			}
+		}
+	}
 
-	for (uint i = 0; i < subEntry.metadata.size(); i++) {
-		buffer.write<uint32_t>(subEntry.metadata[i]);
+	bool contains(const fs::path& path){
+		auto file = files.find(path.lexically_normal().generic_string());
+		if(file == files.end()){
+			return false;
+		}
+		std::pair<uint64_t, int64_t> stat;
+		if(Fingerprints::statFile(path, stat.first, stat.second) && stat == file->second){
+			return true;
+		}
+		files.erase(file);
+		return false;
 	}
+};
 
-}
+// Shared state of a run.
+struct Context {
+	Settings settings;
+	std::unique_ptr<RunReport> report;
+	Journal journal;
+	Fingerprints fingerprints;
+	BlobCache cache;
+	std::atomic<int64_t> archiveBytes{0}; // data of loaded archives, sources and results waiting for their archive to be written.
+	OwnWrites ownWrites;
+	Trace trace;
+	std::unique_ptr<TaskScheduler> scheduler;
+};
 
-void writeEntry(const Entry& entry, Buffer &buffer) {
-		
-	if(!entry.name.empty()){
-		buffer.writeString(entry.name, 4);
+void logReport(const RunReport& report){
+	LOG(kLogInfo) << "Run report:";
+	LOG(kLogInfo) << "\t* Archives: " << report.archives << " (" << report.skippedArchives << " already done, " << report.upToDateArchives << " up to date, " << report.failedArchives << " failed)";
+	LOG(kLogInfo) << "\t* Jobs: " << report.jobs << " (" << report.replaced << " replaced, " << report.upscaled << " upscaled, " << report.resumed << " resumed, " << report.cached << " cached, " << report.failed << " failed)";
+	LOG(kLogInfo) << "\t* Duplicates: " << report.duplicates << " (" << report.duplicateBytes << " bytes of source data upscaled only once)";
+	LOG(kLogInfo) << "\t* Shared blobs: " << report.sharedBlobs << " (" << report.sharedBytes << " bytes saved in output archives)";
+	if(report.verified != 0 || report.verifyFailures != 0){
+		LOG(kLogInfo) << "\t* Verification: " << report.verified << " archive(s) verified, " << report.verifyFailures << " failed, " << report.verifyTime / 1000000 << "ms";
 	}
-	buffer.writeUint24_t(entry.index);
-	buffer.write<unsigned char>(entry.subEntries.size());
-	
-	for (const SubEntry& subEntry : entry.subEntries) {
-		writeSubEntry(subEntry, buffer);
+	LOG(kLogInfo) << "\t* Memory: " << report.peakMemory / (1024 * 1024) << "MB estimated peak, " << report.memoryWaits << " job(s) delayed by the budget";
+
+	for(unsigned int stage = 0; stage < kStageCount; ++stage){
+		const StageReport& stageReport = report.stages[stage];
+		if(stageReport.items == 0){
+			continue;
+		}
+		// Occupancy: share of the run time spent by the stage workers processing items.
+		const double workerTime = double(stageReport.runTime) * stageReport.workers;
+		const double occupancy = workerTime == 0.0 ? 0.0 : 100.0 * double(stageReport.busyTime) / workerTime;
+		LOG(kLogInfo) << "\t* Stage " << stageNames[stage] << ": " << stageReport.workers << " worker(s), " << stageReport.items << " items, "
+			<< int(occupancy) << "% busy, starved " << stageReport.starvedTime / 1000000 << "ms, blocked " << stageReport.blockedTime / 1000000 << "ms, "
+			<< "queue " << stageReport.averageQueueSize << "/" << stageReport.queueCapacity;
 	}
+}
 
+// Counters of a report by name, and whether merging reports of separate runs keeps their maximum instead of their sum.
+template<typename Report, typename Visitor>
+void visitReportCounters(Report& report, Visitor visit){
+	visit("archives", report.archives, false);
+	visit("jobs", report.jobs, false);
+	visit("duplicates", report.duplicates, false);
+	visit("duplicateBytes", report.duplicateBytes, false);
+	visit("skippedArchives", report.skippedArchives, false);
+	visit("upToDateArchives", report.upToDateArchives, false);
+	visit("failedArchives", report.failedArchives, false);
+	visit("replaced", report.replaced, false);
+	visit("resumed", report.resumed, false);
+	visit("cached", report.cached, false);
+	visit("upscaled", report.upscaled, false);
+	visit("failed", report.failed, false);
+	visit("sharedBlobs", report.sharedBlobs, false);
+	visit("sharedBytes", report.sharedBytes, false);
+	visit("verified", report.verified, false);
+	visit("verifyFailures", report.verifyFailures, false);
+	visit("verifyTime", report.verifyTime, false);
+	visit("peakMemory", report.peakMemory, true);
+	visit("memoryWaits", report.memoryWaits, false);
 }
 
-void writeDirectory(const Directory& directory, FILE* file) {
-	Buffer buffer;
-	buffer.resize(directory.size * sizeof(uint32_t));
-	buffer.write<uint32_t>(directory.size);
-	
-	for(const Entry& entry : directory.entries){
-		writeEntry(entry, buffer);
+// Report of a run, as one "name value" line per counter and one line per stage.
+bool writeRunReport(const RunReport& report, const fs::path& path){
+	std::ofstream file(path.string());
+	file << "m3pack-report" << "\n";
+	visitReportCounters(report, [&file](const char* name, const auto& value, bool){
+		file << name << " " << uint64_t(value) << "\n";
+	});
+	for(unsigned int stage = 0; stage < kStageCount; ++stage){
+		const StageReport& stageReport = report.stages[stage];
+		file << "stage " << stageNames[stage] << " " << stageReport.workers << " " << stageReport.items << " " << stageReport.busyTime << " "
+			<< stageReport.starvedTime << " " << stageReport.blockedTime << " " << stageReport.runTime << " " << stageReport.queueCapacity << " " << stageReport.averageQueueSize << "\n";
 	}
-	assert(buffer.data.size() == directory.size * sizeof(uint32_t));
+	return bool(file);
+}
 
-	if(directory.encoded){
-		encryptHeader(buffer, file);
-	} else {
-		fwrite(buffer.data.data(), sizeof(unsigned char), buffer.data.size(), file);
+// Add a saved report to the given one. Runs on separate shards are considered concurrent.
+bool mergeRunReport(RunReport& report, const fs::path& path){
+	std::ifstream file(path.string());
+	std::string line;
+	if(!std::getline(file, line) || line != "m3pack-report"){
+		return false;
+	}
+	while(std::getline(file, line)){
+		std::istringstream record(line);
+		std::string name;
+		record >> name;
+		if(name == "stage"){
+			std::string stageName;
+			StageReport other;
+			record >> stageName >> other.workers >> other.items >> other.busyTime >> other.starvedTime >> other.blockedTime >> other.runTime >> other.queueCapacity >> other.averageQueueSize;
+			const auto stagePos = std::find(stageNames, stageNames + kStageCount, stageName);
+			if(!record || stagePos == stageNames + kStageCount){
+				return false;
+			}
+			StageReport& stageReport = report.stages[stagePos - stageNames];
+			const uint64_t items = stageReport.items + other.items;
+			if(items != 0){
+				stageReport.averageQueueSize = (stageReport.averageQueueSize * stageReport.items + other.averageQueueSize * other.items) / double(items);
+			}
+			stageReport.items = items;
+			stageReport.workers += other.workers;
+			stageReport.busyTime += other.busyTime;
+			stageReport.starvedTime += other.starvedTime;
+			stageReport.blockedTime += other.blockedTime;
+			stageReport.runTime = std::max(stageReport.runTime, other.runTime);
+			stageReport.queueCapacity = std::max(stageReport.queueCapacity, other.queueCapacity);
+			continue;
+		}
+		uint64_t value = 0;
+		record >> value;
+		visitReportCounters(report, [&](const char* counterName, auto& counter, bool keepMax){
+			if(name == counterName){
+				counter = keepMax ? std::max<uint64_t>(counter, value) : counter + value;
+			}
+		});
 	}
+	return true;
 }
 
-void logDirectory(const Directory& directory) {
-	std::cout << "Directory: size: " << directory.size << ", " << (directory.encoded ? "encoded" : "readable") << std::endl;
-
-	for(const Entry& entry : directory.entries){
-		std::cout << "* Entry: \"" << entry.name << "\", index:" << entry.index << std::endl;
-
-		for(const SubEntry& subEntry : entry.subEntries){
-			std::cout << "\t* Subentry: " << getResourceTypeName(subEntry.type) << ", face " << int(subEntry.face) << ", offset:" << subEntry.offset << ", size:" << subEntry.size << std::endl;
-			
-			const size_t metadataToDisplayCount = std::min(size_t(4), subEntry.metadata.size());
-			if(metadataToDisplayCount != 0){
-				std::cout << "\t\tMetadata (" << subEntry.metadata.size() << ")";
-				for(size_t i = 0; i < metadataToDisplayCount; ++i){
-					std::cout << ", " << subEntry.metadata[i];
-				}
-				std::cout << std::endl;
-			}
+// Combine journals or reports written by runs on separate shards, depending on the kind of the first file.
+bool mergeShardFiles(const fs::path& mergedPath, const std::vector<fs::path>& shardPaths){
+	std::ifstream first(shardPaths[0].string());
+	std::string header;
+	std::getline(first, header);
+	if(header.compare(0, 15, "m3pack-journal ") == 0){
+		return Journal::merge(mergedPath, shardPaths);
+	}
+	if(header == Fingerprints::header()){
+		return Fingerprints::merge(mergedPath, shardPaths);
+	}
+	if(header != "m3pack-report"){
+		LOG(kLogError) << "Unknown file kind at path " << shardPaths[0];
+		return false;
+	}
+	RunReport report;
+	for(const fs::path& shardPath : shardPaths){
+		if(!mergeRunReport(report, shardPath)){
+			LOG(kLogError) << "Could not read report at path " << shardPath;
+			return false;
 		}
-	} 
+	}
+	logReport(report);
+	if(!writeRunReport(report, mergedPath)){
+		LOG(kLogError) << "Could not write report at path " << mergedPath;
+		return false;
+	}
+	return true;
+}
+
+std::string formatMegabytes(int64_t bytes){
+	std::ostringstream str;
+	str.setf(std::ios::fixed);
+	str.precision(1);
+	str << double(bytes) / (1024.0 * 1024.0) << "MB";
+	return str.str();
 }
 
-void writeJPEGToEntryFunc(void *context, void *data, int size){
-	std::vector<unsigned char>& vector = *((std::vector<unsigned char>*)context);
+// Should be called once no job is running.
+void logMemoryReport(MemoryTracker& tracker){
+	const size_t kListedArchives = 5;
+	std::lock_guard<std::mutex> lock(tracker.mutex);
+	LOG(kLogInfo) << "Memory report:";
+	for(const MemoryPhase& phase : tracker.phases){
+		LOG(kLogInfo) << "\t* Phase " << phase.name << ": peak RSS " << formatMegabytes(phase.peakRss) << ", average " << formatMegabytes(int64_t(phase.averageRss))
+			<< ", tracked peak " << formatMegabytes(phase.peakTracked) << ", average " << formatMegabytes(int64_t(phase.averageTracked));
+	}
+	std::string categories;
+	for(unsigned int category = 0; category < kMemoryCategoryCount; ++category){
+		categories += (category == 0 ? "" : ", ") + memoryCategoryNames[category] + " " + formatMegabytes(tracker.categories[category].peak);
+	}
+	LOG(kLogInfo) << "\t* Tracked peak: " << formatMegabytes(tracker.total.peak) << " (" << categories << ")";
+	for(const auto& jobType : tracker.jobTypes){
+		const MemoryJobType& stats = jobType.second;
+		LOG(kLogInfo) << "\t* Jobs " << jobType.first << ": " << stats.count << ", average peak " << formatMegabytes(stats.peakSum / int64_t(stats.count)) << ", largest " << formatMegabytes(stats.peak);
+	}
+	if(!tracker.largestJob.empty()){
+		LOG(kLogInfo) << "\t* Largest job: " << tracker.largestJob << " (" << formatMegabytes(tracker.largestJobPeak) << ")";
+	}
+	std::vector<std::pair<std::string, int64_t>> archives(tracker.archives);
+	std::sort(archives.begin(), archives.end(), [](const std::pair<std::string, int64_t>& a, const std::pair<std::string, int64_t>& b){
+		return a.second > b.second;
+	});
+	for(size_t i = 0; i < std::min(archives.size(), kListedArchives); ++i){
+		LOG(kLogInfo) << "\t* Archive " << archives[i].first << ": peak " << formatMegabytes(archives[i].second);
+	}
+	if(archives.size() > kListedArchives){
+		LOG(kLogInfo) << "\t* ...and " << (archives.size() - kListedArchives) << " smaller archive(s)";
+	}
+}
 
-	size_t prevSize = vector.size();
-	vector.resize(prevSize + size);
-	memcpy(&vector[prevSize], data, size);
- }
+// Directory containing the upscaled images of an archive.
+fs::path getUpscaledArchivePath(const fs::path& upscaledDir, const fs::path& relativeFile){
+	const fs::path parentDirectory = relativeFile.parent_path();
+	const std::string baseFileName = relativeFile.stem().string();
+	std::string baseExtension = relativeFile.extension().string(); // including "."
+	if(!baseExtension.empty() && baseExtension[0] == '.'){
+		baseExtension = baseExtension.substr(1);
+	}
+	return upscaledDir / parentDirectory / (baseFileName + "-" + baseExtension);
+}
 
+void trackArchiveData(Context& context, Archive& archive, int64_t size){
+	context.archiveBytes += size;
+	trackMemory(kMemoryBlobs, size, nullptr, &archive.memory);
+}
 
-int main(int argc, char** argv){
+// Messages are written to log, so that archives loaded in parallel don't interleave their output.
+bool loadArchive(Context& context, Archive& archive, LogBuffer& log){
+	TraceSpan span(context.trace, "load archive", "archive", archive.traceLabel);
+	const Settings& settings = context.settings;
+	const fs::path inFilePath = settings.inputDir / archive.relativeFile;
+	FILE* inFile = fopen(inFilePath.c_str(), "rb");
 
-	if(argc < 4){
-		std::cout << "executable path/to/input_dir path/to/upscaled_dir path/to/output_dir input_dir/subpath/to/nodes.m3a [-names]" << std::endl;
-		return 0;
+	if(!inFile){
+		LOG_TO(log, kLogError) << "Could not open file at path " << inFilePath;
+		return false;
 	}
+	LOG_TO(log, kLogInfo) << "Reading " << inFilePath;
 
-	const fs::path inputDir(argv[1]); 
-	const fs::path upscaledDir(argv[2]); 
-	const fs::path outputDir(argv[3]); 
-	const fs::path inputFile(argv[4]); 
-	const fs::path relativeFile = inputFile.lexically_relative(inputDir);
+	readDirectory(inFile, archive.directory, settings.expectNames);
 
-	bool expectNames = false;
-	bool passthrough = false;
+	if(logger().enabled(kLogVerbose)){
+		std::ostringstream directoryLog;
+		logDirectory(archive.directory, directoryLog);
+		LOG_TO(log, kLogVerbose) << directoryLog.str();
+	}
 
-	for(int i = 5; i < argc; ++i){
-		const std::string arg(argv[i]);
-		if(arg == "-names"){
-			expectNames = true;
-		} else if(arg == "-passthrough"){
-			passthrough = true;
+	// Load corresponding data, all ranges at once.
+	std::vector<IORequest> requests;
+	std::vector<SubEntry*> blobs;
+	for(Entry& entry : archive.directory.entries){
+		for(SubEntry& subEntry : entry.subEntries){
+			if(subEntry.data.empty()){
+				continue;
+			}
+			assert(subEntry.data.size() == subEntry.size);
+			requests.push_back({ fileno(inFile), subEntry.data.data(), subEntry.data.size(), subEntry.offset, false });
+			blobs.push_back(&subEntry);
 		}
 	}
+	const bool success = AsyncIO::forThread(settings.io).submit(requests);
+	fclose(inFile);
+	int64_t dataSize = 0;
+	for(const IORequest& request : requests){
+		dataSize += request.size;
+	}
+	trackArchiveData(context, archive, dataSize);
+	if(!success){
+		LOG_TO(log, kLogError) << "Could not read data from file at path " << inFilePath;
+		return false;
+	}
+
+	context.scheduler->parallelFor(0, blobs.size(), 16, [&blobs](size_t first, size_t last){
+		for(size_t i = first; i < last; ++i){
+			blobs[i]->hash = hashData(blobs[i]->data.data(), blobs[i]->data.size());
+		}
+	});
 
-	const fs::path inFilePath = inputDir / relativeFile;
-	const fs::path outFilePath = outputDir / relativeFile;
-	fs::create_directories(outFilePath.parent_path());
+	archive.upscaledArchivePath = getUpscaledArchivePath(settings.upscaledDir, archive.relativeFile);
+	archive.defaultEntryName = archive.relativeFile.stem().string().substr(0,4);
+	return true;
+}
 
-	// Parse input file.
-	Directory directory;
+std::string getEntryFullName(const Archive& archive, const Entry& entry){
+	const std::string& entryName = entry.name.empty() ? archive.defaultEntryName : entry.name;
+	return entryName + "-" + std::to_string(entry.index);
+}
 
-	{
-		FILE* inFile = fopen(inFilePath.c_str(), "rb");
+// Source blobs already scheduled, with the index of the request or job processing them.
+using BlobIndex = std::unordered_map<uint64_t, std::vector<std::pair<const SubEntry*, size_t>>>;
 
-		if(!inFile){
-			std::cout << "Could not open file at path " << inFilePath << std::endl;
-			return -1;
+bool sameSourceData(const SubEntry& a, const SubEntry& b){
+	return a.hash == b.hash && a.data == b.data;
+}
+
+// Find an identical source blob already in the index, or register this one with the given index.
+bool findOrRegisterBlob(BlobIndex& index, const SubEntry& subEntry, size_t newId, size_t& existingId){
+	std::vector<std::pair<const SubEntry*, size_t>>& candidates = index[subEntry.hash];
+	for(const auto& candidate : candidates){
+		if(sameSourceData(*candidate.first, subEntry)){
+			existingId = candidate.second;
+			return true;
 		}
-		std::cout << "Reading " << inFilePath << std::endl;
+	}
+	candidates.emplace_back(&subEntry, newId);
+	return false;
+}
 
-		readDirectory(inFile, directory, expectNames);
+// Write the original of each image lacking an edited version to tmpDir, and register it for the external upscaler.
+// Identical images are only upscaled once, the result is copied for the others.
+void collectUpscaleRequests(const Archive& archive, const fs::path& tmpDir, std::vector<UpscaleRequest>& requests, BlobIndex& requestsIndex){
+	const fs::path tmpArchiveDir = tmpDir / archive.relativeFile;
+	fs::create_directories(tmpArchiveDir);
 
+	for(const Entry& entry : archive.directory.entries){
+		const std::string entryFullName = getEntryFullName(archive, entry);
 
-#define LOG_ENTRIES
-#ifdef LOG_ENTRIES
-	logDirectory(directory);
-#endif
-		
-		// Load corresponding data.
-		for(Entry& entry : directory.entries){
-			for(SubEntry& subEntry : entry.subEntries){
-				if(subEntry.data.empty()){
-					continue;
-				}
-				assert(subEntry.data.size() == subEntry.size);
-				fseek(inFile, subEntry.offset, SEEK_SET);
-				fread(subEntry.data.data(), sizeof(unsigned char), subEntry.data.size(), inFile);
+		for(const SubEntry& subEntry : entry.subEntries){
+			const std::string fileStem = subEntry.data.empty() ? "" : getSubEntryFileStem(entryFullName, subEntry);
+			if(fileStem.empty() || fs::exists(archive.upscaledArchivePath / (fileStem + "-edit.jpeg"))){
+				continue;
+			}
+			const fs::path outputPath = archive.upscaledArchivePath / (fileStem + "-edit.jpeg");
+			size_t existingId = 0;
+			if(findOrRegisterBlob(requestsIndex, subEntry, requests.size(), existingId)){
+				requests[existingId].copies.push_back(outputPath);
+				continue;
 			}
-		} 
 
-		fclose(inFile);
+			const fs::path inputPath = tmpArchiveDir / (fileStem + ".jpeg");
+			FILE* tmpFile = fopen(inputPath.c_str(), "wb");
+			bool written = false;
+			if(tmpFile){
+				written = fwrite(subEntry.data.data(), sizeof(unsigned char), subEntry.data.size(), tmpFile) == subEntry.data.size();
+				written = fclose(tmpFile) == 0 && written;
+			}
+			if(!written){
+				LOG(kLogError) << "Could not write upscaler input at path " << inputPath;
+				std::error_code ec;
+				fs::remove(inputPath, ec);
+			}
+			// Always register the request, to keep indices in sync; a missing input will make the command fail.
+			requests.push_back({ inputPath, outputPath, {} });
+		}
 	}
+}
 
-	// Modify data in some entries (and metadata?)
-	if(!passthrough){
-		bool dataModified = false;
-		
-		fs::path parentDirectory = relativeFile.parent_path();
-		std::string baseFileName = relativeFile.stem().string();
-		std::string baseExtension = relativeFile.extension().string(); // including "."
-		if(!baseExtension.empty() && baseExtension[0] == '.'){
-			baseExtension = baseExtension.substr(1);
+// Rough relative cost of a job, in pixels touched. Loading a replacement only copies the compressed file,
+// while the fallback decodes the source, then resizes and encodes a picture UPSCALE_FACTOR^2 times larger.
+const int kImageChannels = 3;
+
+// Cost is used to order jobs, memory to admit them in the pipeline.
+void estimateJob(Job& job){
+	int w = 0, h = 0, c = 0;
+	if(job.cachedData){
+		job.cost = job.memory = job.cachedData->size();
+		return;
+	}
+	if(job.hasReplacement || !job.resumedFilePath.empty()){
+		const fs::path& filePath = job.hasReplacement ? job.upscaledFilePath : job.resumedFilePath;
+		// The file is stored as is.
+		std::error_code error;
+		const uintmax_t fileSize = fs::file_size(filePath, error);
+		job.memory = error ? job.subEntry->data.size() : uint64_t(fileSize);
+		if(!stbi_info(filePath.c_str(), &w, &h, &c)){
+			job.cost = job.subEntry->data.size();
+			return;
 		}
-		fs::path upscaledArchivePath = upscaledDir / parentDirectory / (baseFileName + "-" + baseExtension);
+		job.cost = uint64_t(w) * uint64_t(h) / 8;
+		return;
+	}
+	if(!stbi_info_from_memory(job.subEntry->data.data(), job.subEntry->data.size(), &w, &h, &c)){
+		job.cost = job.memory = job.subEntry->data.size();
+		return;
+	}
+	const uint64_t pixels = uint64_t(w) * uint64_t(h);
+	job.cost = pixels * (1 + 2 * UPSCALE_FACTOR * UPSCALE_FACTOR);
+	// Decoded and upscaled images, and the encoder output, at most half the raw upscaled size at max quality.
+	const uint64_t upscaledSize = pixels * kImageChannels * UPSCALE_FACTOR * UPSCALE_FACTOR;
+	job.memory = pixels * kImageChannels + upscaledSize + upscaledSize / 2;
+}
 
-		std::cout << "Searching for upscaled data in " << upscaledArchivePath.generic_string() << std::endl;
+void prepareJobs(Context& context, Archive& archive, std::vector<Job>& jobs, LogBuffer& log){
+	TraceSpan span(context.trace, "prepare jobs", "archive", archive.traceLabel);
 
-		const std::string defaultEntryName = baseFileName.substr(0,4);
-		const std::string cubeSuffixes[] = {"", "back", "bottom", "front", "left", "right", "top"};
+	LOG_TO(log, kLogInfo) << "Searching for upscaled data in " << archive.upscaledArchivePath.generic_string();
 
-		// * For each subentry, find the corresponding file on disk.
-		for(Entry& entry : directory.entries){
-			const std::string& entryName = entry.name.empty() ? defaultEntryName : entry.name;
-			const std::string entryFullName = entryName + "-" + std::to_string(entry.index);
+	// * For each subentry, find the corresponding file on disk.
+	for(Entry& entry : archive.directory.entries){
+		const std::string entryFullName = getEntryFullName(archive, entry);
 
-			for(SubEntry& subEntry : entry.subEntries){
-				// No data to update.
-				if(subEntry.data.empty()){
-					continue;
-				}
-				// Rescale spot items
-				if(subEntry.type == kSpotItem || subEntry.type == kLocalizedSpotItem){
-					subEntry.metadata[0] *= UPSCALE_FACTOR;
-					subEntry.metadata[1] *= UPSCALE_FACTOR;
-				}
-				std::string fileName;
-				if(subEntry.type == kSpotItem){
-					fileName = entryFullName + "-" + std::to_string(subEntry.type) + "-" + std::to_string(subEntry.face) + "-edit.jpeg";
-				}
-				if(subEntry.type == kLocalizedSpotItem || subEntry.type == kLocalizedFrame){
-					fileName = entryFullName + "-" + std::to_string(subEntry.type - 24) + "-" + std::to_string(subEntry.face) + "-edit.jpeg";
-				
-				}
-				if(subEntry.type == kFrame){
-					fileName = entryFullName + "-" + std::to_string(subEntry.type) + "-edit.jpeg";
-				}
-				if(subEntry.type == kCubeFace){
-					fileName = entryFullName + "-" + cubeSuffixes[subEntry.face] + "-edit.jpeg";
-				}
-				if(fileName.empty()){
-					continue;
-				}
-				const fs::path upscaledFilePath = upscaledArchivePath / fileName;
-
-				std::cout << "- Looking for file: " << fileName << "...";
-
-				if(fs::exists(upscaledFilePath)){
-					// * If exists, load it (jpeg only)
-					FILE* upFile = fopen(upscaledFilePath.c_str(), "rb");
-					if(upFile){
-						std::cout << " OK" << std::endl;
-
-						// * Update data size
-						fseek(upFile, 0, SEEK_END);
-						subEntry.data.resize(ftell(upFile));
-						subEntry.size = subEntry.data.size();
-						// * Copy jpeg blob.
-						fseek(upFile, 0L, SEEK_SET);
-						fread(subEntry.data.data(), sizeof(unsigned char), subEntry.data.size(), upFile);
-						fclose(upFile);
-						// Next item
-						dataModified = true;
-						continue;
-					}
-				}
+		for(SubEntry& subEntry : entry.subEntries){
+			// No data to update.
+			if(subEntry.data.empty()){
+				continue;
+			}
+			// Rescale spot items
+			if(subEntry.type == kSpotItem || subEntry.type == kLocalizedSpotItem){
+				subEntry.metadata[0] *= UPSCALE_FACTOR;
+				subEntry.metadata[1] *= UPSCALE_FACTOR;
+			}
+			const std::string fileStem = getSubEntryFileStem(entryFullName, subEntry);
+			if(fileStem.empty()){
+				continue;
+			}
+			const std::string fileName = fileStem + "-edit.jpeg";
 
-				// If we reached this path, the file didn't exist, we have to upscale manually.
-				std::cout << "  X Falling back to basic upscaling." << std::endl;
-				
-				int w, h, c;
-				const int tgtChannels = 3;
+			Job job;
+			job.archive = &archive;
+			job.subEntry = &subEntry;
+			job.upscaledFilePath = archive.upscaledArchivePath / fileName;
+			jobs.push_back(job);
+		}
+	}
 
-				stbi_uc* decodedImg = stbi_load_from_memory(subEntry.data.data(), subEntry.data.size(), &w, &h, &c, tgtChannels);
-				if(!decodedImg){
-					std::cout << "Unable to decode JPEG file" << std::endl;
-					continue;
-				}
+	// Probing files is independent for each subentry.
+	context.scheduler->parallelFor(0, jobs.size(), 4, [&jobs](size_t first, size_t last){
+		for(size_t i = first; i < last; ++i){
+			jobs[i].hasReplacement = fs::exists(jobs[i].upscaledFilePath);
+			estimateJob(jobs[i]);
+		}
+	});
 
-				unsigned int tgtWidth  = UPSCALE_FACTOR * w;
-				unsigned int tgtHeight = UPSCALE_FACTOR * h;
-				std::vector<unsigned char> upscaledImg(tgtWidth * tgtHeight * tgtChannels);
-#define SMOOTH_RESIZE
-#ifdef SMOOTH_RESIZE
-				int res = stbir_resize_uint8(decodedImg, w, h, 0, upscaledImg.data(), tgtWidth, tgtHeight, 0, tgtChannels);
-				if(res == 0){
-					std::cout << "Unable to uscale image" << std::endl;
-					continue;
-				}
-#else
-				for(uint32_t y = 0; y < h; ++y){
-					uint32_t rowSrcIndex = y * w * tgtChannels;
+	for(const Job& job : jobs){
+		// If the file didn't exist, we have to upscale manually.
+		LOG_TO(log, kLogVerbose) << "- Looking for file: " << job.upscaledFilePath.filename().string() << "..." << (job.hasReplacement ? " OK" : "  X Falling back to basic upscaling.");
+	}
+	archive.pendingJobs = jobs.size();
+}
 
-					for(uint32_t x = 0; x < w; ++x){
-						uint32_t baseSrcIndex = rowSrcIndex + x * tgtChannels;
+// Merge fallback jobs processing identical source blobs, across all archives.
+void deduplicateJobs(std::vector<Job>& jobs, RunReport& report){
+	BlobIndex index;
+	std::vector<Job> uniqueJobs;
+	uniqueJobs.reserve(jobs.size());
+
+	for(Job& job : jobs){
+		size_t existingId = 0;
+		if(!job.hasReplacement && findOrRegisterBlob(index, *job.subEntry, uniqueJobs.size(), existingId)){
+			uniqueJobs[existingId].duplicates.push_back({ job.archive, job.subEntry });
+			++report.duplicates;
+			report.duplicateBytes += job.subEntry->data.size();
+			continue;
+		}
+		uniqueJobs.push_back(std::move(job));
+	}
+	jobs = std::move(uniqueJobs);
+}
 
-						unsigned char rgb[3];
-						for(uint32_t i = 0; i < tgtChannels; ++i){
-							rgb[i] = decodedImg[baseSrcIndex + i];
-						}
+// Reuse upscaled images completed by a previous run.
+void resumeJobs(std::vector<Job>& jobs, const Journal& journal){
+	for(Job& job : jobs){
+		if(!job.hasReplacement && journal.findBlob(*job.subEntry, job.resumedFilePath)){
+			estimateJob(job);
+		}
+	}
+}
 
-						for(uint dy = 0; dy < UPSCALE_FACTOR; ++dy){
-							uint32_t rowDstIndex = (y + dy) * tgtWidth * tgtChannels;
-							for(uint dx = 0; dx < UPSCALE_FACTOR; ++dx){
-								uint32_t baseDstIndex = rowDstIndex + (x + dx) * tgtChannels;
-								for(uint32_t i = 0; i < tgtChannels; ++i){
-									upscaledImg[baseDstIndex + i] = rgb[i];
-								}
-							}
-						}
-					}
+void useCachedBlobs(std::vector<Job>& jobs, BlobCache& cache){
+	for(Job& job : jobs){
+		if(!job.hasReplacement && job.resumedFilePath.empty()){
+			job.cachedData = cache.find(*job.subEntry);
+			if(job.cachedData){
+				estimateJob(job);
+			}
+		}
+	}
+}
+
+// Check that all blobs are stored after the header, and that their ranges either don't overlap,
+// or are exactly shared by subentries with identical data.
+bool verifyLayout(const Directory& directory, size_t& sharedCount){
+	std::vector<const SubEntry*> blobs;
+	for(const Entry& entry : directory.entries){
+		for(const SubEntry& subEntry : entry.subEntries){
+			if(!subEntry.data.empty()){
+				blobs.push_back(&subEntry);
+			}
+		}
+	}
+	std::sort(blobs.begin(), blobs.end(), [](const SubEntry* a, const SubEntry* b){
+		return a->offset < b->offset || (a->offset == b->offset && a->size < b->size);
+	});
+
+	sharedCount = 0;
+	uint64_t currentEnd = directory.size * sizeof(uint32_t);
+	const SubEntry* previous = nullptr;
+	for(const SubEntry* blob : blobs){
+		if(blob->size != blob->data.size()){
+			return false;
+		}
+		if(previous && blob->offset == previous->offset && blob->size == previous->size){
+			if(blob->data != previous->data){
+				return false;
+			}
+			++sharedCount;
+			continue;
+		}
+		if(blob->offset < currentEnd){
+			return false;
+		}
+		currentEnd = uint64_t(blob->offset) + blob->size;
+		previous = blob;
+	}
+	return true;
+}
+
+// Bytes of the file not referenced by the directory.
+uint64_t countDeadBytes(const Directory& directory, uint64_t fileSize){
+	uint64_t liveBytes = directory.size * sizeof(uint32_t);
+	std::unordered_set<uint32_t> offsets;
+	for(const Entry& entry : directory.entries){
+		for(const SubEntry& subEntry : entry.subEntries){
+			if(!subEntry.data.empty() && offsets.insert(subEntry.offset).second){
+				liveBytes += subEntry.size;
+			}
+		}
+	}
+	return fileSize > liveBytes ? fileSize - liveBytes : 0;
+}
+
+// Check a written archive against the directory and blobs it was written from: the header decodes
+// to the same directory, blobs are inside the file and only overlap when shared, and their bytes
+// are identical. Fresh archives must also contain no other data than the header and the blobs.
+bool checkWrittenArchive(Context& context, const Directory& directory, const fs::path& filePath, bool allowDeadSpace, std::string& failure){
+	FILE* file = fopen(filePath.c_str(), "rb");
+	struct stat fileStat;
+	if(!file || fstat(fileno(file), &fileStat) != 0){
+		if(file){
+			fclose(file);
+		}
+		failure = "could not open the file";
+		return false;
+	}
+	const uint64_t fileSize = fileStat.st_size;
+	const uint64_t headerSize = directory.size * sizeof(uint32_t);
+
+	// Check the header size before decoding it.
+	uint32_t firstWord = 0;
+	bool encrypted = false;
+	if(fread(&firstWord, sizeof(uint32_t), 1, file) != 1 || decodeHeaderSize(firstWord, encrypted) != directory.size || encrypted != directory.encoded || fileSize < headerSize){
+		fclose(file);
+		failure = "the header size or encryption differs";
+		return false;
+	}
+	Directory written;
+	readDirectory(file, written, context.settings.expectNames, false);
+	fclose(file);
+
+	// Same directory, and blobs to compare.
+	std::vector<std::pair<const SubEntry*, const SubEntry*>> blobs;
+	bool sameDirectory = written.entries.size() == directory.entries.size();
+	for(size_t i = 0; sameDirectory && i < directory.entries.size(); ++i){
+		const Entry& entry = directory.entries[i];
+		const Entry& writtenEntry = written.entries[i];
+		sameDirectory = entry.index == writtenEntry.index && entry.subEntries.size() == writtenEntry.subEntries.size()
+			&& (!context.settings.expectNames || entry.name == writtenEntry.name);
+		for(size_t j = 0; sameDirectory && j < entry.subEntries.size(); ++j){
+			const SubEntry& subEntry = entry.subEntries[j];
+			const SubEntry& writtenSubEntry = writtenEntry.subEntries[j];
+			sameDirectory = subEntry.offset == writtenSubEntry.offset && subEntry.size == writtenSubEntry.size && subEntry.face == writtenSubEntry.face
+				&& subEntry.type == writtenSubEntry.type && subEntry.metadata == writtenSubEntry.metadata;
+			if(!subEntry.data.empty()){
+				blobs.emplace_back(&subEntry, &writtenSubEntry);
+			}
+		}
+	}
+	if(!sameDirectory){
+		failure = "the header doesn't match the directory";
+		return false;
+	}
+
+	// Sweep over blobs sorted by offset.
+	std::vector<const SubEntry*> ranges;
+	for(const std::pair<const SubEntry*, const SubEntry*>& blob : blobs){
+		ranges.push_back(blob.second);
+	}
+	std::sort(ranges.begin(), ranges.end(), [](const SubEntry* a, const SubEntry* b){
+		return a->offset < b->offset || (a->offset == b->offset && a->size < b->size);
+	});
+	uint64_t liveBytes = headerSize;
+	uint64_t currentEnd = headerSize;
+	const SubEntry* previous = nullptr;
+	for(const SubEntry* range : ranges){
+		if(previous && range->offset == previous->offset && range->size == previous->size){
+			continue;
+		}
+		if(range->offset < currentEnd || uint64_t(range->offset) + range->size > fileSize){
+			failure = "a blob overlaps another one or the end of the file";
+			return false;
+		}
+		currentEnd = uint64_t(range->offset) + range->size;
+		liveBytes += range->size;
+		previous = range;
+	}
+	if(!allowDeadSpace && liveBytes != fileSize){
+		failure = "the file contains " + std::to_string(fileSize - liveBytes) + " bytes not referenced by the header";
+		return false;
+	}
+
+	// Compare checksums of the stored blobs with the intended ones.
+	const int fd = open(filePath.c_str(), O_RDONLY);
+	void* mapping = fd < 0 || fileSize == 0 ? MAP_FAILED : mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	if(fd >= 0){
+		close(fd);
+	}
+	if(mapping == MAP_FAILED){
+		failure = "could not map the file";
+		return false;
+	}
+	const unsigned char* fileData = (const unsigned char*)mapping;
+	std::atomic<size_t> mismatches{0};
+	context.scheduler->parallelFor(0, blobs.size(), 16, [&](size_t first, size_t last){
+		for(size_t i = first; i < last; ++i){
+			const SubEntry& subEntry = *blobs[i].first;
+			if(hashData(subEntry.data.data(), subEntry.data.size()) != hashData(fileData + subEntry.offset, subEntry.size)){
+				++mismatches;
+			}
+		}
+	});
+	munmap(mapping, fileSize);
+	if(mismatches != 0){
+		failure = std::to_string(mismatches) + " blob(s) differ from the intended data";
+		return false;
+	}
+	return true;
+}
+
+bool verifyWrittenArchive(Context& context, const Archive& archive, const fs::path& filePath, bool allowDeadSpace){
+	const auto start = std::chrono::steady_clock::now();
+	std::string failure;
+	const bool success = checkWrittenArchive(context, archive.directory, filePath, allowDeadSpace, failure);
+	context.report->verifyTime += elapsedNs(start);
+	if(!success){
+		++context.report->verifyFailures;
+		LOG(kLogError) << "Verification failed for " << archive.relativeFile << ": " << failure;
+		return false;
+	}
+	++context.report->verified;
+	return true;
+}
+
+enum UpdateResult {
+	kUpdateDone, kUpdateFailed, kUpdateIncompatible
+};
+
+// Update an existing output archive in place: unchanged blobs are kept, new blobs are stored in space
+// referenced by neither the previous nor the new header, then the header is rewritten. Until then the file
+// still holds the previous archive, and the ranges of replaced blobs are only reused by a later update.
+// An update interrupted while writing the header is repaired by running it again, as blobs are compared with the stored data.
+UpdateResult updateArchive(Context& context, Archive& archive, const fs::path& outFilePath){
+	const Settings& settings = context.settings;
+	Directory& directory = archive.directory;
+
+	FILE* outFile = fopen(outFilePath.c_str(), "r+b");
+	if(!outFile){
+		return kUpdateIncompatible;
+	}
+	const int fd = fileno(outFile);
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) != 0){
+		fclose(outFile);
+		return kUpdateIncompatible;
+	}
+	const uint64_t fileSize = fileStat.st_size;
+	const uint64_t headerSize = directory.size * sizeof(uint32_t);
+
+	// The header has to keep the same size, and subentries are matched by position.
+	// Stored data is only allocated below for the blobs that can be compared.
+	Directory stored;
+	readDirectory(outFile, stored, settings.expectNames, false);
+	bool compatible = stored.size == directory.size && stored.entries.size() == directory.entries.size();
+	for(size_t i = 0; compatible && i < directory.entries.size(); ++i){
+		const Entry& entry = directory.entries[i];
+		const Entry& storedEntry = stored.entries[i];
+		compatible = entry.index == storedEntry.index && entry.subEntries.size() == storedEntry.subEntries.size();
+		for(size_t j = 0; compatible && j < entry.subEntries.size(); ++j){
+			compatible = entry.subEntries[j].type == storedEntry.subEntries[j].type;
+		}
+	}
+	if(!compatible){
+		fclose(outFile);
+		return kUpdateIncompatible;
+	}
+
+	// Read stored blobs that may be identical to the new ones.
+	std::vector<std::pair<SubEntry*, SubEntry*>> blobs;
+	std::vector<IORequest> requests;
+	for(size_t i = 0; i < directory.entries.size(); ++i){
+		for(size_t j = 0; j < directory.entries[i].subEntries.size(); ++j){
+			SubEntry& subEntry = directory.entries[i].subEntries[j];
+			SubEntry& storedSubEntry = stored.entries[i].subEntries[j];
+			if(subEntry.data.empty()){
+				continue;
+			}
+			const bool inFile = storedSubEntry.offset >= headerSize && uint64_t(storedSubEntry.offset) + storedSubEntry.size <= fileSize;
+			if(inFile && storedSubEntry.size == subEntry.data.size()){
+				storedSubEntry.data.resize(storedSubEntry.size);
+				requests.push_back({ fd, storedSubEntry.data.data(), storedSubEntry.data.size(), storedSubEntry.offset, false });
+			}
+			blobs.emplace_back(&subEntry, &storedSubEntry);
+		}
+	}
+	AsyncIO::forThread(settings.io).submit(requests);
+	for(const IORequest& request : requests){
+		if(!request.success()){
+			for(const std::pair<SubEntry*, SubEntry*>& blob : blobs){
+				if(blob.second->data.data() == request.buffer){
+					std::vector<unsigned char>().swap(blob.second->data);
 				}
+			}
+		}
+	}
 
-#endif
-				stbi_image_free(decodedImg);
-				std::vector<unsigned char> encodedUpscaledImg;
+	// Unchanged blobs keep their range, blobs referenced by the header on disk keep theirs until it is replaced.
+	std::unordered_map<uint64_t, std::vector<const SubEntry*>> storedBlobs;
+	std::vector<std::pair<uint64_t, uint64_t>> liveRanges;
+	std::vector<SubEntry*> changedBlobs;
+	for(const std::pair<SubEntry*, SubEntry*>& blob : blobs){
+		SubEntry& subEntry = *blob.first;
+		if(blob.second->data != subEntry.data){
+			changedBlobs.push_back(&subEntry);
+			continue;
+		}
+		subEntry.offset = blob.second->offset;
+		liveRanges.emplace_back(subEntry.offset, uint64_t(subEntry.offset) + subEntry.data.size());
+		if(settings.shareBlobs){
+			storedBlobs[hashData(subEntry.data.data(), subEntry.data.size())].push_back(&subEntry);
+		}
+	}
+	std::vector<std::pair<uint64_t, uint64_t>> usedRanges(liveRanges);
+	for(const Entry& storedEntry : stored.entries){
+		for(const SubEntry& storedSubEntry : storedEntry.subEntries){
+			const uint64_t storedEnd = uint64_t(storedSubEntry.offset) + storedSubEntry.size;
+			if(storedSubEntry.size != 0 && storedSubEntry.offset >= headerSize && storedEnd <= fileSize){
+				usedRanges.emplace_back(storedSubEntry.offset, storedEnd);
+			}
+		}
+	}
+	std::sort(usedRanges.begin(), usedRanges.end());
+	std::vector<std::pair<uint64_t, uint64_t>> gaps;
+	uint64_t endOffset = headerSize;
+	for(const std::pair<uint64_t, uint64_t>& range : usedRanges){
+		if(range.first > endOffset){
+			gaps.emplace_back(endOffset, range.first);
+		}
+		endOffset = std::max(endOffset, range.second);
+	}
+
+	// Place new blobs in the first gap large enough, or at the end.
+	std::vector<IORequest> writeRequests;
+	for(SubEntry* subEntry : changedBlobs){
+		const size_t size = subEntry->data.size();
+		if(settings.shareBlobs){
+			std::vector<const SubEntry*>& candidates = storedBlobs[hashData(subEntry->data.data(), size)];
+			auto sharedBlob = std::find_if(candidates.begin(), candidates.end(), [subEntry](const SubEntry* candidate){
+				return candidate->data == subEntry->data;
+			});
+			if(sharedBlob != candidates.end()){
+				subEntry->offset = (*sharedBlob)->offset;
+				continue;
+			}
+			candidates.push_back(subEntry);
+		}
+		auto gap = std::find_if(gaps.begin(), gaps.end(), [size](const std::pair<uint64_t, uint64_t>& gap){
+			return gap.second - gap.first >= size;
+		});
+		if(gap != gaps.end()){
+			subEntry->offset = gap->first;
+			gap->first += size;
+		} else {
+			subEntry->offset = endOffset;
+			endOffset += size;
+		}
+		writeRequests.push_back({ fd, subEntry->data.data(), size, subEntry->offset, true });
+	}
+
+	size_t sharedCount = 0;
+	if(!verifyLayout(directory, sharedCount)){
+		fclose(outFile);
+		LOG(kLogError) << "Invalid layout for archive " << archive.relativeFile << ", skipping.";
+		return kUpdateFailed;
+	}
+
+	// Blobs are on disk before the header references them, and the file is only shortened once the new header is.
+	uint64_t usedEnd = headerSize;
+	for(const Entry& entry : directory.entries){
+		for(const SubEntry& subEntry : entry.subEntries){
+			if(!subEntry.data.empty()){
+				usedEnd = std::max(usedEnd, uint64_t(subEntry.offset) + subEntry.data.size());
+			}
+		}
+	}
+	bool success = AsyncIO::forThread(settings.io).submit(writeRequests) && fdatasync(fd) == 0;
+	if(success){
+		fseek(outFile, 0, SEEK_SET);
+		writeDirectory(directory, outFile);
+		success = fflush(outFile) == 0 && fdatasync(fd) == 0;
+	}
+	if(success && usedEnd < endOffset){
+		success = ftruncate(fd, usedEnd) == 0 && fdatasync(fd) == 0;
+	}
+	success = fclose(outFile) == 0 && success;
+	if(!success){
+		LOG(kLogError) << "Could not update file at path " << outFilePath;
+		return kUpdateFailed;
+	}
+	if(settings.verify && !verifyWrittenArchive(context, archive, outFilePath, true)){
+		return kUpdateFailed;
+	}
+	if(context.journal.enabled()){
+		context.journal.recordArchive(archive.relativeFile);
+	}
+	context.fingerprints.record(archive.relativeFile, archive.fingerprint, outFilePath);
+	context.report->sharedBlobs += sharedCount;
+
+	const uint64_t deadBytes = countDeadBytes(directory, usedEnd);
+	LOG(kLogInfo) << "Updated " << outFilePath << " (" << writeRequests.size() << " blobs rewritten, " << deadBytes << " bytes of dead space)";
+	if(deadBytes * kCompactionRatio > usedEnd){
+		LOG(kLogWarning) << "Dead space is large, you can reclaim it with -compact.";
+	}
+	return kUpdateDone;
+}
 
-				res = stbi_write_jpg_to_func(writeJPEGToEntryFunc, (void*)&encodedUpscaledImg, tgtWidth, tgtHeight, tgtChannels, upscaledImg.data(), 100 /* max quality */);
-				if(res == 0){
-					std::cout << "Unable to encode JPEG" << std::endl;
+void releaseArchiveData(Context& context, Archive& archive){
+	int64_t dataSize = 0;
+	for(Entry& entry : archive.directory.entries){
+		for(SubEntry& subEntry : entry.subEntries){
+			dataSize += subEntry.data.size();
+			std::vector<unsigned char>().swap(subEntry.data);
+		}
+	}
+	trackArchiveData(context, archive, -dataSize);
+	if(memoryTracker().enabled){
+		memoryTracker().recordArchive(archive.relativeFile.string(), archive.memory.peak);
+	}
+}
+
+bool writeArchive(Context& context, Archive& archive){
+	TraceSpan span(context.trace, "write archive", "archive", archive.traceLabel);
+	const Settings& settings = context.settings;
+	RunReport& report = *context.report;
+	Directory& directory = archive.directory;
+	const fs::path outFilePath = settings.outputDir / archive.relativeFile;
+
+	// Only write changed blobs to an existing output archive if possible.
+	if(settings.updateInPlace && fs::exists(outFilePath)){
+		const UpdateResult result = updateArchive(context, archive, outFilePath);
+		if(result != kUpdateIncompatible){
+			releaseArchiveData(context, archive);
+			return result == kUpdateDone;
+		}
+	}
+
+	// Update offsets
+	// The first blob goes after the header, which won't change size fortunately.
+	if(archive.dataModified){
+		uint32_t currentOffset = directory.size * sizeof(uint32_t);
+		// Subentries with identical data can point to a single stored copy.
+		std::unordered_map<uint64_t, std::vector<const SubEntry*>> storedBlobs;
+		// Then append in the same order.
+		for(Entry& entry : directory.entries){
+			for(SubEntry& subEntry : entry.subEntries){
+				if(subEntry.data.empty()){
 					continue;
 				}
-				// Update entry.
-				subEntry.data = encodedUpscaledImg;
-				subEntry.size = subEntry.data.size();
-					
-				dataModified = true;
-			}
-		}
-
-		// Update offsets
-		// The first blob goes after the header, which won't change size fortunately.
-		if(dataModified){
-			uint32_t currentOffset = directory.size * sizeof(uint32_t);
-			// Then append in the same order.
-			for(Entry& entry : directory.entries){
-				for(SubEntry& subEntry : entry.subEntries){
-					if(subEntry.data.empty()){
+				if(settings.shareBlobs){
+					std::vector<const SubEntry*>& candidates = storedBlobs[hashData(subEntry.data.data(), subEntry.data.size())];
+					auto stored = std::find_if(candidates.begin(), candidates.end(), [&subEntry](const SubEntry* candidate){
+						return candidate->data == subEntry.data;
+					});
+					if(stored != candidates.end()){
+						subEntry.offset = (*stored)->offset;
 						continue;
 					}
-					subEntry.offset = currentOffset;
-					currentOffset += subEntry.data.size();
+					candidates.push_back(&subEntry);
 				}
+				subEntry.offset = currentOffset;
+				currentOffset += subEntry.data.size();
 			}
 		}
 	}
-	
-	// Now pack and encode the header.
 
-	FILE* outFile = fopen(outFilePath.c_str(), "wb");
+	size_t sharedCount = 0;
+	if(!verifyLayout(directory, sharedCount)){
+		LOG(kLogError) << "Invalid layout for archive " << archive.relativeFile << ", skipping.";
+		releaseArchiveData(context, archive);
+		return false;
+	}
+
+	// Now pack and encode the header.
+	const fs::path tmpFilePath = makeTmpPath(outFilePath);
+	std::error_code ec;
+	fs::create_directories(outFilePath.parent_path(), ec);
+
+	FILE* outFile = fopen(tmpFilePath.c_str(), "wb");
+	if(!outFile){
+		LOG(kLogError) << "Could not write file at path " << outFilePath;
+		releaseArchiveData(context, archive);
+		return false;
+	}
 	writeDirectory(directory, outFile);
-	// Write corresponding data
-	for(const Entry& entry : directory.entries){
-		for(const SubEntry& subEntry : entry.subEntries){
+	fflush(outFile);
+	// Write corresponding data at their final offsets, once per stored range.
+	std::unordered_set<uint32_t> writtenOffsets;
+	std::vector<IORequest> requests;
+	size_t sharedBytes = 0;
+	for(Entry& entry : directory.entries){
+		for(SubEntry& subEntry : entry.subEntries){
 			if(subEntry.data.empty()){
 				continue;
 			}
-			fseek(outFile, subEntry.offset, SEEK_SET);
-			fwrite(subEntry.data.data(), sizeof(unsigned char), subEntry.data.size(), outFile);
+			if(writtenOffsets.insert(subEntry.offset).second){
+				requests.push_back({ fileno(outFile), subEntry.data.data(), subEntry.data.size(), subEntry.offset, true });
+			} else {
+				sharedBytes += subEntry.data.size();
+			}
 		}
 	}
-	fclose(outFile);
+	const bool submitted = AsyncIO::forThread(settings.io).submit(requests);
+	const bool success = closeSyncedFile(outFile) && submitted;
+	// Check the result before it replaces the previous output. Unmodified archives keep the layout of the input, which can contain gaps.
+	const bool verified = !success || !settings.verify || verifyWrittenArchive(context, archive, tmpFilePath, !archive.dataModified);
+
+	// Release blobs as soon as possible, other archives of the batch may still be in flight.
+	releaseArchiveData(context, archive);
+	if(!success){
+		fs::remove(tmpFilePath, ec);
+		LOG(kLogError) << "Could not write data to file at path " << outFilePath;
+		return false;
+	}
+	if(!verified){
+		fs::remove(tmpFilePath, ec);
+		return false;
+	}
+
+	fs::rename(tmpFilePath, outFilePath, ec);
+	if(ec){
+		fs::remove(tmpFilePath, ec);
+		LOG(kLogError) << "Could not move file to path " << outFilePath;
+		return false;
+	}
+	// The journal must not record an archive that could be lost.
+	if(!syncDirectory(outFilePath.parent_path())){
+		LOG(kLogError) << "Could not sync directory of file at path " << outFilePath;
+		return false;
+	}
+	if(context.journal.enabled()){
+		context.journal.recordArchive(archive.relativeFile);
+	}
+	context.fingerprints.record(archive.relativeFile, archive.fingerprint, outFilePath);
+	report.sharedBlobs += sharedCount;
+	report.sharedBytes += sharedBytes;
 
+	LOG(kLogInfo) << "Wrote " << outFilePath << (sharedCount != 0 ? " (" + std::to_string(sharedCount) + " shared blobs)" : "");
+	return true;
+}
 
-	return 0;
-}
\ No newline at end of file
+// Data of a job moving through the pipeline stages.
+struct PipelineItem {
+	MemoryCounter memory; // declared first, as buffers below release their allocations from it.
+	Job* job;
+	std::vector<unsigned char> data; // compressed image, loaded or encoded.
+	std::unique_ptr<stbi_uc, void(*)(void*)> decoded{nullptr, stbi_image_free};
+	std::vector<unsigned char> upscaled;
+	int width{0};
+	int height{0};
+	uint32_t traceId{0};
+	uint32_t traceLabel{Trace::kNoLabel};
+	uint64_t traceStart{0}; // when the job was dispatched.
+	uint64_t traceQueued{0}; // when the item entered its current queue.
+	bool loaded{false}; // data can be used as-is.
+	bool failed{false};
+};
+
+const unsigned int kResizeBandRows = 64 * UPSCALE_FACTOR;
+
+// Replacement and resumed files of a batch of items are read concurrently.
+void readStage(std::vector<std::unique_ptr<PipelineItem>>& items, Context& context){
+	std::vector<IORequest> requests;
+	std::vector<PipelineItem*> owners;
+
+	for(std::unique_ptr<PipelineItem>& item : items){
+		const Job& job = *item->job;
+		if(job.cachedData){
+			item->data = *job.cachedData;
+			item->loaded = true;
+			++context.report->cached;
+			continue;
+		}
+		const fs::path* filePath = !job.resumedFilePath.empty() ? &job.resumedFilePath : (job.hasReplacement ? &job.upscaledFilePath : nullptr);
+		if(!filePath){
+			continue;
+		}
+		const int fd = open(filePath->c_str(), O_RDONLY);
+		struct stat fileStat;
+		if(fd < 0 || fstat(fd, &fileStat) != 0 || fileStat.st_size == 0){
+			if(fd >= 0){
+				close(fd);
+			}
+			continue;
+		}
+		item->data.resize(fileStat.st_size);
+		requests.push_back({ fd, item->data.data(), item->data.size(), 0, false });
+		owners.push_back(item.get());
+	}
+
+	AsyncIO::forThread(context.settings.io).submit(requests);
+
+	for(size_t i = 0; i < requests.size(); ++i){
+		close(requests[i].fd);
+		PipelineItem& item = *owners[i];
+		const Job& job = *item.job;
+		if(!requests[i].success()){
+			item.data.clear();
+			continue;
+		}
+		// Result of a previous run, only used if it wasn't damaged by the interruption.
+		if(!job.resumedFilePath.empty()){
+			if(!context.journal.isValidBlob(*job.subEntry, item.data)){
+				item.data.clear();
+				continue;
+			}
+			++context.report->resumed;
+		} else {
+			++context.report->replaced;
+		}
+		item.loaded = true;
+	}
+	for(std::unique_ptr<PipelineItem>& item : items){
+		trackMemory(kMemoryOutput, item->data.size(), &item->memory, &item->job->archive->memory);
+	}
+}
+
+void decodeStage(PipelineItem& item){
+	if(item.loaded || item.failed){
+		return;
+	}
+	const std::vector<unsigned char>& source = item.job->subEntry->data;
+	int c;
+	item.decoded.reset(stbi_load_from_memory(source.data(), source.size(), &item.width, &item.height, &c, kImageChannels));
+	if(!item.decoded){
+		LOG(kLogError) << "Unable to decode JPEG file";
+		item.failed = true;
+	}
+}
+
+void resizeStage(PipelineItem& item, Context& context){
+	if(item.loaded || item.failed){
+		return;
+	}
+	const int w = item.width;
+	const int h = item.height;
+	const stbi_uc* decodedImg = item.decoded.get();
+	const int tgtChannels = kImageChannels;
+
+	unsigned int tgtWidth  = UPSCALE_FACTOR * w;
+	unsigned int tgtHeight = UPSCALE_FACTOR * h;
+	std::vector<unsigned char>& upscaledImg = item.upscaled;
+	upscaledImg.resize(tgtWidth * tgtHeight * tgtChannels);
+	trackMemory(kMemoryPixels, upscaledImg.size(), &item.memory, &item.job->archive->memory);
+#define SMOOTH_RESIZE
+#ifdef SMOOTH_RESIZE
+	// Resize horizontal bands in parallel, each band uses the same transform as a full resize with an offset, so the result is identical.
+	const unsigned int bandCount = (tgtHeight + kResizeBandRows - 1) / kResizeBandRows;
+	std::atomic<bool> success{true};
+	context.scheduler->parallelFor(0, bandCount, 1, [&](size_t firstBand, size_t lastBand){
+		// Bands can run on threads busy with other jobs.
+		MemoryScope scope(&item.memory, &item.job->archive->memory);
+		for(size_t band = firstBand; band < lastBand; ++band){
+			const unsigned int y0 = band * kResizeBandRows;
+			const unsigned int y1 = std::min(tgtHeight, y0 + kResizeBandRows);
+			int res = stbir_resize_subpixel(decodedImg, w, h, 0, upscaledImg.data() + size_t(y0) * tgtWidth * tgtChannels, tgtWidth, y1 - y0, 0,
+				STBIR_TYPE_UINT8, tgtChannels, STBIR_ALPHA_CHANNEL_NONE, 0, STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_FILTER_DEFAULT,
+				STBIR_COLORSPACE_LINEAR, nullptr, float(UPSCALE_FACTOR), float(UPSCALE_FACTOR), 0.0f, float(y0));
+			if(res == 0){
+				success = false;
+			}
+		}
+	});
+	if(!success){
+		LOG(kLogError) << "Unable to uscale image";
+		item.failed = true;
+	}
+#else
+	for(uint32_t y = 0; y < h; ++y){
+		uint32_t rowSrcIndex = y * w * tgtChannels;
+
+		for(uint32_t x = 0; x < w; ++x){
+			uint32_t baseSrcIndex = rowSrcIndex + x * tgtChannels;
+
+			unsigned char rgb[3];
+			for(uint32_t i = 0; i < tgtChannels; ++i){
+				rgb[i] = decodedImg[baseSrcIndex + i];
+			}
+
+			for(uint dy = 0; dy < UPSCALE_FACTOR; ++dy){
+				uint32_t rowDstIndex = (y + dy) * tgtWidth * tgtChannels;
+				for(uint dx = 0; dx < UPSCALE_FACTOR; ++dx){
+					uint32_t baseDstIndex = rowDstIndex + (x + dx) * tgtChannels;
+					for(uint32_t i = 0; i < tgtChannels; ++i){
+						upscaledImg[baseDstIndex + i] = rgb[i];
+					}
+				}
+			}
+		}
+	}
+
+#endif
+	item.decoded.reset();
+}
+
+void encodeStage(PipelineItem& item, Context& context){
+	if(item.loaded || item.failed){
+		return;
+	}
+	const int tgtWidth = UPSCALE_FACTOR * item.width;
+	const int tgtHeight = UPSCALE_FACTOR * item.height;
+	int res = stbi_write_jpg_to_func(writeJPEGToEntryFunc, (void*)&item.data, tgtWidth, tgtHeight, kImageChannels, item.upscaled.data(), 100 /* max quality */);
+	trackMemory(kMemoryOutput, item.data.size(), &item.memory, &item.job->archive->memory);
+	trackMemory(kMemoryPixels, -int64_t(item.upscaled.size()), &item.memory, &item.job->archive->memory);
+	std::vector<unsigned char>().swap(item.upscaled);
+	if(res == 0){
+		LOG(kLogError) << "Unable to encode JPEG";
+		item.failed = true;
+		return;
+	}
+	if(context.journal.enabled()){
+		context.journal.recordBlob(*item.job->subEntry, item.data);
+	}
+	if(context.cache.enabled){
+		context.cache.store(*item.job->subEntry, item.data);
+	}
+	++context.report->upscaled;
+}
+
+// Update the subentries with the result, and write archives that are now complete.
+void writeStage(PipelineItem& item, Context& context){
+	Job& job = *item.job;
+	const bool modified = !item.failed;
+	if(item.failed){
+		++context.report->failed;
+	}
+
+	// Share the result with duplicates before any archive can be written and release its data.
+	std::vector<JobTarget> targets = { { job.archive, job.subEntry } };
+	targets.insert(targets.end(), job.duplicates.begin(), job.duplicates.end());
+	trackMemory(kMemoryOutput, -int64_t(item.data.size()), &item.memory, &job.archive->memory);
+	if(memoryTracker().enabled){
+		memoryTracker().recordJob(getResourceTypeName(job.subEntry->type), job.archive->relativeFile.string() + ": " + job.upscaledFilePath.filename().string(), item.memory.peak);
+	}
+	for(size_t i = 0; i < targets.size(); ++i){
+		SubEntry& subEntry = *targets[i].subEntry;
+		if(modified){
+			trackArchiveData(context, *targets[i].archive, int64_t(item.data.size()) - int64_t(subEntry.data.size()));
+			// Update entry.
+			if(i + 1 == targets.size()){
+				subEntry.data = std::move(item.data);
+			} else {
+				subEntry.data = item.data;
+			}
+			subEntry.size = subEntry.data.size();
+		}
+	}
+	for(const JobTarget& target : targets){
+		if(modified){
+			target.archive->dataModified = true;
+		}
+		if(target.archive->pendingJobs.fetch_sub(1) == 1 && !writeArchive(context, *target.archive)){
+			++context.report->failedArchives;
+		}
+	}
+}
+
+// Stages run as tasks on the shared scheduler. Each stage has an input queue and a number of slots
+// (concurrent tasks). A stage only starts a task if the next queue has room for its results,
+// which propagates backpressure up to the dispatch of new jobs.
+struct Pipeline {
+	using ItemPtr = std::unique_ptr<PipelineItem>;
+	using Batch = std::vector<ItemPtr>;
+
+	Context& context;
+	TaskGroup group;
+	std::mutex mutex;
+	// Queue i feeds stage i, the first one holds all jobs in dispatch order.
+	std::deque<ItemPtr> queues[kStageCount];
+	unsigned int active[kStageCount] = {};
+	// Items being processed by a stage, that will be pushed to the next queue.
+	size_t reserved[kStageCount] = {};
+	std::function<void(Batch&)> processes[kStageCount];
+	size_t batchSizes[kStageCount];
+
+	std::atomic<uint64_t> items[kStageCount];
+	std::atomic<uint64_t> busyTime[kStageCount];
+	uint64_t starvedTime[kStageCount] = {};
+	uint64_t blockedTime[kStageCount] = {};
+	double queueSizeIntegral[kStageCount] = {};
+	std::chrono::steady_clock::time_point lastUpdate;
+	// Estimated memory of the jobs between their read and their write.
+	uint64_t memoryInUse{0};
+	uint64_t peakMemory{0};
+	size_t memoryWaits{0};
+	bool waitingForMemory{false};
+
+	explicit Pipeline(Context& ctx) : context(ctx) {
+		auto forEachItem = [](std::function<void(PipelineItem&)> process){
+			return [process](Batch& batch){
+				for(ItemPtr& item : batch){
+					MemoryScope scope(&item->memory, &item->job->archive->memory);
+					process(*item);
+				}
+			};
+		};
+		processes[kStageRead] = [this](Batch& batch){ readStage(batch, context); };
+		processes[kStageDecode] = forEachItem([](PipelineItem& item){ decodeStage(item); });
+		processes[kStageResize] = forEachItem([this](PipelineItem& item){ resizeStage(item, context); });
+		processes[kStageEncode] = forEachItem([this](PipelineItem& item){ encodeStage(item, context); });
+		processes[kStageWrite] = forEachItem([this](PipelineItem& item){ writeStage(item, context); });
+
+		for(unsigned int stage = 0; stage < kStageCount; ++stage){
+			// Reads are grouped to keep several requests in flight.
+			batchSizes[stage] = stage == kStageRead ? std::max(1u, context.settings.io.queueDepth) : 1;
+			items[stage] = 0;
+			busyTime[stage] = 0;
+		}
+	}
+
+	unsigned int slots(unsigned int stage) const {
+		return std::max(1u, context.settings.pipeline.workers[stage]);
+	}
+
+	// Slot time left unused since the last update, because the stage had no input (starved) or no room for its output (blocked).
+	void accountIdleTime(){
+		const auto now = std::chrono::steady_clock::now();
+		const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastUpdate).count();
+		lastUpdate = now;
+		for(unsigned int stage = 0; stage < kStageCount; ++stage){
+			const uint64_t idleTime = uint64_t(slots(stage) - std::min(active[stage], slots(stage))) * elapsed;
+			(queues[stage].empty() ? starvedTime[stage] : blockedTime[stage]) += idleTime;
+			queueSizeIntegral[stage] += double(queues[stage].size()) * double(elapsed);
+		}
+	}
+
+	// Number of jobs at the front of the first queue fitting in the memory budget, along with the data of loaded archives.
+	// A job is always admitted if no other job is running, so that it can't wait forever.
+	size_t admitJobs(size_t count){
+		const uint64_t budget = context.settings.pipeline.maxMemory;
+		const uint64_t archiveBytes = uint64_t(std::max<int64_t>(0, context.archiveBytes));
+		size_t admitted = 0;
+		for(; admitted < count; ++admitted){
+			const uint64_t memory = queues[kStageRead][admitted]->job->memory;
+			if(budget != 0 && memoryInUse != 0 && archiveBytes + memoryInUse + memory > budget){
+				if(!waitingForMemory){
+					waitingForMemory = true;
+					++memoryWaits;
+				}
+				break;
+			}
+			waitingForMemory = false;
+			memoryInUse += memory;
+		}
+		peakMemory = std::max(peakMemory, archiveBytes + memoryInUse);
+		return admitted;
+	}
+
+	// Start as many tasks as possible, from the last stage to the first one to free room early. Called with the mutex held.
+	void schedule(){
+		accountIdleTime();
+		const size_t capacity = std::max(size_t(1), context.settings.pipeline.queueSize);
+
+		for(int stage = kStageCount - 1; stage >= 0; --stage){
+			while(active[stage] < slots(stage) && !queues[stage].empty()){
+				size_t room = queues[stage].size();
+				if(stage + 1 < kStageCount){
+					const size_t used = queues[stage + 1].size() + reserved[stage + 1];
+					if(used >= capacity){
+						break;
+					}
+					room = capacity - used;
+				}
+				size_t count = std::min(std::min(batchSizes[stage], room), queues[stage].size());
+				if(stage == kStageRead){
+					count = admitJobs(count);
+					if(count == 0){
+						break;
+					}
+				}
+				std::shared_ptr<Batch> batch(new Batch());
+				const uint64_t traceTime = context.trace.enabled ? context.trace.now() : 0;
+				for(size_t i = 0; i < count; ++i){
+					batch->push_back(std::move(queues[stage].front()));
+					queues[stage].pop_front();
+					if(context.trace.enabled){
+						const PipelineItem& item = *batch->back();
+						context.trace.recordAsync(queueSpanNames[stage], "job", item.traceId, item.traceQueued, traceTime, item.traceLabel);
+					}
+				}
+				++active[stage];
+				if(stage + 1 < kStageCount){
+					reserved[stage + 1] += count;
+				}
+				context.scheduler->spawn(group, [this, stage, batch](){ runTask(stage, *batch); });
+			}
+		}
+	}
+
+	void runTask(unsigned int stage, Batch& batch){
+		const auto start = std::chrono::steady_clock::now();
+		{
+			// Batches of reads are not attributed to a single job.
+			TraceSpan span(context.trace, stageNames[stage].c_str(), "stage", batch.size() == 1 ? batch[0]->traceLabel : Trace::kNoLabel);
+			processes[stage](batch);
+		}
+		busyTime[stage] += elapsedNs(start);
+		items[stage] += batch.size();
+		const uint64_t traceTime = context.trace.enabled ? context.trace.now() : 0;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		accountIdleTime();
+		--active[stage];
+		if(stage + 1 < kStageCount){
+			reserved[stage + 1] -= batch.size();
+			for(ItemPtr& item : batch){
+				item->traceQueued = traceTime;
+				queues[stage + 1].push_back(std::move(item));
+			}
+		} else {
+			for(const ItemPtr& item : batch){
+				memoryInUse -= item->job->memory;
+				if(context.trace.enabled){
+					context.trace.recordAsync("job", "job", item->traceId, item->traceStart, traceTime, item->traceLabel);
+				}
+			}
+		}
+		schedule();
+	}
+
+	void run(std::vector<Job>& jobs){
+		const auto runStart = std::chrono::steady_clock::now();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			const uint64_t traceTime = context.trace.enabled ? context.trace.now() : 0;
+			for(Job& job : jobs){
+				ItemPtr item(new PipelineItem());
+				item->job = &job;
+				if(context.trace.enabled){
+					item->traceId = context.trace.newId();
+					item->traceLabel = context.trace.registerLabel(job.archive->relativeFile.string() + ": " + job.upscaledFilePath.filename().string());
+					item->traceStart = item->traceQueued = traceTime;
+				}
+				queues[kStageRead].push_back(std::move(item));
+			}
+			lastUpdate = runStart;
+			schedule();
+		}
+		context.scheduler->wait(group);
+		const uint64_t runTime = elapsedNs(runStart);
+		// Accumulated over the batches of a run.
+		RunReport& report = *context.report;
+		report.peakMemory = std::max(report.peakMemory, peakMemory);
+		report.memoryWaits += memoryWaits;
+
+		for(unsigned int stage = 0; stage < kStageCount; ++stage){
+			StageReport& stageReport = report.stages[stage];
+			const double queueSizeTotal = stageReport.averageQueueSize * double(stageReport.runTime) + queueSizeIntegral[stage];
+			stageReport.workers = slots(stage);
+			stageReport.items += items[stage];
+			stageReport.busyTime += busyTime[stage];
+			stageReport.starvedTime += starvedTime[stage];
+			stageReport.blockedTime += blockedTime[stage];
+			stageReport.runTime += runTime;
+			stageReport.queueCapacity = std::max(stageReport.queueCapacity, stage == kStageRead ? jobs.size() : std::max(size_t(1), context.settings.pipeline.queueSize));
+			stageReport.averageQueueSize = stageReport.runTime == 0 ? 0.0 : queueSizeTotal / double(stageReport.runTime);
+		}
+	}
+};
+
+// Jobs of all archives are dispatched in longest-processing-time-first order,
+// so that the largest images don't end up alone at the tail of the run.
+// Archives are written by the last stage once all their jobs are complete.
+void runPipeline(Context& context, std::vector<Job>& jobs){
+	std::stable_sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b){
+		return a.cost > b.cost;
+	});
+	Pipeline pipeline(context);
+	pipeline.run(jobs);
+}
+
+// Gather archives to process from a file or a directory (recursively).
+void collectInputFiles(const fs::path& inputDir, const fs::path& inputPath, std::vector<fs::path>& relativeFiles){
+	if(!fs::is_directory(inputPath)){
+		relativeFiles.push_back(inputPath.lexically_relative(inputDir));
+		return;
+	}
+	std::vector<fs::path> files;
+	for(const fs::directory_entry& item : fs::recursive_directory_iterator(inputPath)){
+		if(item.is_regular_file() && item.path().extension() == ".m3a"){
+			files.push_back(item.path().lexically_relative(inputDir));
+		}
+	}
+	std::sort(files.begin(), files.end());
+	relativeFiles.insert(relativeFiles.end(), files.begin(), files.end());
+}
+
+// Estimated processing time of an archive, in the units of estimateJob, as if every image was decoded,
+// resized and encoded. Only the input archive is considered: whether edits exist can differ between
+// machines or change during a run, and all shards must agree on the partition.
+uint64_t estimateArchiveCost(const Settings& settings, const fs::path& relativeFile){
+	ArchiveReader reader;
+	if(!reader.open((settings.inputDir / relativeFile).string(), settings.expectNames)){
+		return 0;
+	}
+	const FlatDirectory& directory = reader.directory;
+	uint64_t cost = directory.size;
+	BlobSpan blob;
+	for(uint32_t subEntry = 0; subEntry < directory.subEntryCount(); ++subEntry){
+		const uint32_t entry = directory.entryIds[subEntry];
+		const std::string entryFullName = reader.entryName(entry) + "-" + std::to_string(directory.indices[entry]);
+		const std::string fileStem = getSubEntryFileStem(entryFullName, directory.type(subEntry), directory.faces[subEntry]);
+		if(fileStem.empty() || directory.sizes[subEntry] == 0 || !reader.read(subEntry, blob)){
+			continue;
+		}
+		int w = 0, h = 0, c = 0;
+		if(!stbi_info_from_memory(blob.data, blob.size, &w, &h, &c)){
+			cost += blob.size;
+			continue;
+		}
+		const uint64_t pixels = uint64_t(w) * uint64_t(h);
+		cost += settings.passthrough ? 0 : pixels * (1 + 2 * UPSCALE_FACTOR * UPSCALE_FACTOR);
+	}
+	return cost;
+}
+
+// Keep the archives of one shard. Archives are assigned from the most to the least expensive to the
+// least loaded shard, ties broken by the hash of their path, so that every process computes the same
+// balanced partition from the same inputs, whatever the order of its arguments.
+void selectShard(Context& context, std::vector<fs::path>& relativeFiles){
+	const Settings& settings = context.settings;
+	std::vector<uint64_t> costs(relativeFiles.size());
+	context.scheduler->parallelFor(0, relativeFiles.size(), 1, [&](size_t first, size_t last){
+		for(size_t i = first; i < last; ++i){
+			costs[i] = estimateArchiveCost(settings, relativeFiles[i]);
+		}
+	});
+	std::vector<uint64_t> hashes(relativeFiles.size());
+	std::vector<size_t> order(relativeFiles.size());
+	for(size_t i = 0; i < relativeFiles.size(); ++i){
+		const std::string name = relativeFiles[i].generic_string();
+		hashes[i] = hashData((const unsigned char*)name.data(), name.size());
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+		return costs[a] > costs[b] || (costs[a] == costs[b] && (hashes[a] < hashes[b] || (hashes[a] == hashes[b] && relativeFiles[a] < relativeFiles[b])));
+	});
+	std::vector<uint64_t> loads(settings.shardCount, 0);
+	std::vector<char> selected(relativeFiles.size(), 0);
+	uint64_t totalCost = 0;
+	for(size_t i : order){
+		const size_t shard = std::min_element(loads.begin(), loads.end()) - loads.begin();
+		loads[shard] += costs[i];
+		totalCost += costs[i];
+		selected[i] = shard == settings.shardIndex;
+	}
+	std::vector<fs::path> shardFiles;
+	for(size_t i = 0; i < relativeFiles.size(); ++i){
+		if(selected[i]){
+			shardFiles.push_back(relativeFiles[i]);
+		}
+	}
+	LOG(kLogInfo) << "Shard " << settings.shardIndex << "/" << settings.shardCount << ": " << shardFiles.size() << " of " << relativeFiles.size()
+		<< " archive(s), " << (totalCost == 0 ? 100 : 100 * loads[settings.shardIndex] / totalCost) << "% of the estimated cost.";
+	relativeFiles.swap(shardFiles);
+}
+
+// Load, update and write archives, processing their images in a common pipeline.
+void processBatch(Context& context, std::vector<std::unique_ptr<Archive>>& archives){
+	const Settings& settings = context.settings;
+	TaskScheduler& scheduler = *context.scheduler;
+	RunReport& report = *context.report;
+	MemoryTracker& memory = memoryTracker();
+	Fingerprints& fingerprints = context.fingerprints;
+	memory.beginPhase("load");
+
+	// Archives are loaded in parallel, their messages are then displayed in order.
+	std::vector<LogBuffer> archiveLogs(archives.size());
+	std::vector<char> archiveLoaded(archives.size(), 0);
+	{
+		TaskGroup group;
+		for(size_t i = 0; i < archives.size(); ++i){
+			scheduler.spawn(group, [&, i](){
+				archiveLoaded[i] = loadArchive(context, *archives[i], archiveLogs[i]);
+			});
+		}
+		scheduler.wait(group);
+	}
+	// Archives that could not be loaded are skipped, the others are still packed.
+	size_t loadedCount = 0;
+	for(size_t i = 0; i < archives.size(); ++i){
+		logger().write(archiveLogs[i]);
+		if(!archiveLoaded[i]){
+			releaseArchiveData(context, *archives[i]);
+			++report.failedArchives;
+			continue;
+		}
+		archives[loadedCount++] = std::move(archives[i]);
+	}
+	archives.resize(loadedCount);
+
+	// Modify data in some entries (and metadata?)
+	std::vector<Job> jobs;
+	memory.beginPhase("prepare");
+	if(!settings.passthrough){
+
+		// * Hand the original of each missing image to the external upscaler, its outputs will be picked up below.
+		if(!settings.upscaler.command.empty()){
+			const fs::path tmpDir = fs::temp_directory_path() / ("m3pack-" + std::to_string(getpid()));
+			std::vector<UpscaleRequest> requests;
+			BlobIndex requestsIndex;
+			for(const std::unique_ptr<Archive>& archive : archives){
+				collectUpscaleRequests(*archive, tmpDir, requests, requestsIndex);
+			}
+			if(!requests.empty()){
+				LOG(kLogInfo) << "Running upscaler on " << requests.size() << " image(s)";
+				TraceSpan span(context.trace, "upscaler", "run");
+				std::vector<fs::path> writtenFiles;
+				runUpscaler(settings.upscaler, requests, writtenFiles);
+				if(settings.watch){
+					context.ownWrites.record(writtenFiles);
+				}
+			}
+			std::error_code ec;
+			fs::remove_all(tmpDir, ec);
+			// Images added by the upscaler are inputs of this run.
+			if(fingerprints.enabled && !requests.empty()){
+				for(const std::unique_ptr<Archive>& archive : archives){
+					archive->fingerprint = fingerprints.compute(settings.inputDir / archive->relativeFile, archive->upscaledArchivePath);
+				}
+			}
+		}
+
+		std::vector<std::vector<Job>> archiveJobs(archives.size());
+		std::vector<LogBuffer> prepareLogs(archives.size());
+		TaskGroup group;
+		for(size_t i = 0; i < archives.size(); ++i){
+			scheduler.spawn(group, [&, i](){
+				prepareJobs(context, *archives[i], archiveJobs[i], prepareLogs[i]);
+			});
+		}
+		scheduler.wait(group);
+		// Keep the jobs in archive order, so that dispatch doesn't depend on timings.
+		for(size_t i = 0; i < archives.size(); ++i){
+			logger().write(prepareLogs[i]);
+			jobs.insert(jobs.end(), archiveJobs[i].begin(), archiveJobs[i].end());
+		}
+		report.jobs += jobs.size();
+		deduplicateJobs(jobs, report);
+		resumeJobs(jobs, context.journal);
+		if(context.cache.enabled){
+			useCachedBlobs(jobs, context.cache);
+		}
+	}
+
+	// Archives without anything to update can be written right away.
+	{
+		TaskGroup group;
+		for(const std::unique_ptr<Archive>& archive : archives){
+			if(archive->pendingJobs == 0){
+				Archive* archivePtr = archive.get();
+				scheduler.spawn(group, [&context, archivePtr](){
+					if(!writeArchive(context, *archivePtr)){
+						++context.report->failedArchives;
+					}
+				});
+			}
+		}
+		scheduler.wait(group);
+	}
+	memory.beginPhase("pipeline");
+	runPipeline(context, jobs);
+}
+
+// Load, update and write the given archives. If force is set, archives already done in the journal are processed again.
+bool processArchives(Context& context, const std::vector<fs::path>& relativeFiles, bool force){
+	const Settings& settings = context.settings;
+	TaskScheduler& scheduler = *context.scheduler;
+	context.report.reset(new RunReport());
+	RunReport& report = *context.report;
+	report.archives = relativeFiles.size();
+	MemoryTracker& memory = memoryTracker();
+	if(memory.enabled){
+		memory.reset();
+	}
+
+	// Fingerprint the inputs of each archive, to skip those whose output is up to date.
+	Fingerprints& fingerprints = context.fingerprints;
+	std::vector<uint64_t> archiveFingerprints(relativeFiles.size(), 0);
+	if(fingerprints.enabled){
+		scheduler.parallelFor(0, relativeFiles.size(), 1, [&](size_t first, size_t last){
+			for(size_t i = first; i < last; ++i){
+				archiveFingerprints[i] = fingerprints.compute(settings.inputDir / relativeFiles[i], getUpscaledArchivePath(settings.upscaledDir, relativeFiles[i]));
+			}
+		});
+	}
+
+	// Parse input files.
+	std::vector<std::unique_ptr<Archive>> archives;
+	for(size_t i = 0; i < relativeFiles.size(); ++i){
+		const fs::path& relativeFile = relativeFiles[i];
+		if(!force && context.journal.isArchiveDone(relativeFile) && fs::exists(settings.outputDir / relativeFile)){
+			++report.skippedArchives;
+			continue;
+		}
+		if(!force && fingerprints.isUpToDate(relativeFile, archiveFingerprints[i], settings.outputDir / relativeFile)){
+			++report.upToDateArchives;
+			continue;
+		}
+		archives.emplace_back(new Archive());
+		archives.back()->relativeFile = relativeFile;
+		archives.back()->fingerprint = archiveFingerprints[i];
+		archives.back()->traceLabel = context.trace.registerLabel(relativeFile.string());
+	}
+	// With a memory budget, archives are loaded and packed in batches, whose data can be retained until
+	// they are written. Results are estimated as UPSCALE_FACTOR^2 times larger than the sources.
+	// Identical images are only shared between archives of the same batch.
+	const uint64_t budget = settings.pipeline.maxMemory;
+	const uint64_t growth = settings.passthrough ? 1 : UPSCALE_FACTOR * UPSCALE_FACTOR;
+	std::vector<std::unique_ptr<Archive>> batch;
+	uint64_t batchSize = 0;
+	for(size_t i = 0; i < archives.size(); ++i){
+		std::error_code error;
+		const uint64_t archiveSize = growth * uint64_t(fs::file_size(settings.inputDir / archives[i]->relativeFile, error));
+		if(budget != 0 && !batch.empty() && batchSize + archiveSize > budget / 2){
+			processBatch(context, batch);
+			batch.clear();
+			batchSize = 0;
+		}
+		batch.push_back(std::move(archives[i]));
+		batchSize += error ? 0 : archiveSize;
+	}
+	if(!batch.empty()){
+		processBatch(context, batch);
+	}
+	memory.beginPhase("done");
+
+	if(fingerprints.enabled && !fingerprints.save()){
+		LOG(kLogError) << "Could not write fingerprints at path " << fingerprints.path;
+	}
+	logReport(report);
+	if(!settings.reportPath.empty() && !writeRunReport(report, settings.reportPath)){
+		LOG(kLogError) << "Could not write report at path " << settings.reportPath;
+	}
+	if(memory.enabled){
+		logMemoryReport(memory);
+	}
+	// In watch and daemon modes, each run overwrites the trace of the previous one.
+	if(context.trace.enabled){
+		if(context.trace.write(settings.tracePath)){
+			LOG(kLogInfo) << "Trace written to " << settings.tracePath;
+		} else {
+			LOG(kLogError) << "Could not write trace at path " << settings.tracePath;
+		}
+		context.trace.clear();
+	}
+	return report.failedArchives == 0;
+}
+
+// Rewrite archives containing dead space, with their blobs stored contiguously.
+bool compactArchives(Context& context, const std::vector<fs::path>& relativeFiles){
+	const Settings& settings = context.settings;
+	context.report.reset(new RunReport());
+	for(const fs::path& relativeFile : relativeFiles){
+		const fs::path filePath = settings.inputDir / relativeFile;
+		std::error_code error;
+		const uint64_t fileSize = fs::file_size(filePath, error);
+		Archive archive;
+		archive.relativeFile = relativeFile;
+		LogBuffer log;
+		if(error || !loadArchive(context, archive, log)){
+			logger().write(log);
+			return false;
+		}
+		if(countDeadBytes(archive.directory, fileSize) == 0){
+			LOG(kLogInfo) << "No dead space in " << filePath;
+			continue;
+		}
+		// Force offsets to be recomputed.
+		archive.dataModified = true;
+		if(!writeArchive(context, archive)){
+			return false;
+		}
+		// Without sharing, blobs shared in the previous file are duplicated and it can grow.
+		const uint64_t newSize = fs::file_size(filePath, error);
+		if(!error && newSize < fileSize){
+			LOG(kLogInfo) << "Reclaimed " << (fileSize - newSize) << " bytes.";
+		} else if(!error){
+			LOG(kLogInfo) << "No space reclaimed, the archive grew by " << (newSize - fileSize) << " bytes.";
+		}
+	}
+	return true;
+}
+
+// Records of one archive, before concatenation.
+struct CatalogPart {
+	CatalogArchive archive;
+	std::vector<CatalogRecord> records;
+	std::vector<uint32_t> metadata;
+	LogBuffer log;
+};
+
+// Blobs are hashed straight from the mapped archive.
+bool fillCatalogPart(Context& context, const ArchiveReader& reader, CatalogPart& part){
+	const FlatDirectory& directory = reader.directory;
+	part.archive = {};
+	part.archive.fileSize = reader.fileSize;
+	part.archive.headerSize = directory.size * sizeof(uint32_t);
+	part.archive.encoded = directory.encoded;
+	part.metadata = directory.metadata;
+	part.records.resize(directory.subEntryCount());
+
+	std::atomic<bool> success{true};
+	context.scheduler->parallelFor(0, directory.subEntryCount(), 64, [&](size_t first, size_t last){
+		BlobSpan blob;
+		for(uint32_t subEntry = first; subEntry < last; ++subEntry){
+			const uint32_t entry = directory.entryIds[subEntry];
+			const std::string name = reader.entryName(entry);
+			CatalogRecord& record = part.records[subEntry];
+			memset(&record, 0, sizeof(record));
+			memcpy(record.name, name.data(), std::min(name.size(), sizeof(record.name)));
+			record.index = directory.indices[entry];
+			record.type = directory.types[subEntry];
+			record.face = directory.faces[subEntry];
+			record.offset = directory.offsets[subEntry];
+			record.size = directory.sizes[subEntry];
+			record.firstMetadata = directory.metadataStarts[subEntry];
+			record.metadataCount = directory.metadataCounts[subEntry];
+			if(storesData(directory.type(subEntry)) && record.size != 0){
+				if(!reader.read(subEntry, blob)){
+					success = false;
+					continue;
+				}
+				record.hash = hashData(blob.data, blob.size);
+				record.flags = kCatalogHasData;
+			}
+		}
+	});
+	return success;
+}
+
+// Parse all archives and store their directories in a catalog file.
+bool buildCatalog(Context& context, const std::vector<fs::path>& relativeFiles, const fs::path& catalogPath){
+	const Settings& settings = context.settings;
+	TaskScheduler& scheduler = *context.scheduler;
+	context.report.reset(new RunReport());
+
+	std::vector<CatalogPart> parts(relativeFiles.size());
+	std::vector<char> loaded(relativeFiles.size(), 0);
+	TaskGroup group;
+	for(size_t i = 0; i < relativeFiles.size(); ++i){
+		scheduler.spawn(group, [&, i](){
+			const fs::path filePath = settings.inputDir / relativeFiles[i];
+			ArchiveReader reader;
+			if(!reader.open(filePath.string(), settings.expectNames)){
+				LOG_TO(parts[i].log, kLogError) << "Could not open file at path " << filePath;
+				return;
+			}
+			if(!fillCatalogPart(context, reader, parts[i])){
+				LOG_TO(parts[i].log, kLogError) << "Could not read data from file at path " << filePath;
+				return;
+			}
+			loaded[i] = 1;
+		});
+	}
+	scheduler.wait(group);
+
+	// Tables are concatenated in archive order.
+	std::vector<CatalogArchive> archives;
+	std::vector<CatalogRecord> records;
+	std::vector<uint32_t> metadata;
+	std::string strings;
+	for(size_t i = 0; i < parts.size(); ++i){
+		if(!loaded[i]){
+			logger().write(parts[i].log);
+			return false;
+		}
+		CatalogArchive archive = parts[i].archive;
+		const std::string path = relativeFiles[i].generic_string();
+		archive.pathOffset = strings.size();
+		archive.pathSize = path.size();
+		archive.firstRecord = records.size();
+		archive.recordCount = parts[i].records.size();
+		strings += path;
+		for(CatalogRecord record : parts[i].records){
+			record.archive = archives.size();
+			record.firstMetadata += metadata.size();
+			records.push_back(record);
+		}
+		metadata.insert(metadata.end(), parts[i].metadata.begin(), parts[i].metadata.end());
+		archives.push_back(archive);
+	}
+	std::vector<uint32_t> sorted(records.size());
+	for(uint32_t i = 0; i < sorted.size(); ++i){
+		sorted[i] = i;
+	}
+	std::sort(sorted.begin(), sorted.end(), [&records](uint32_t a, uint32_t b){
+		return catalogRecordLess(records[a], records[b]);
+	});
+
+	CatalogHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kCatalogMagic, sizeof(kCatalogMagic));
+	header.version = CATALOG_VERSION;
+	header.archiveCount = archives.size();
+	header.recordCount = records.size();
+	header.metadataCount = metadata.size();
+	header.archivesOffset = sizeof(CatalogHeader);
+	header.recordsOffset = header.archivesOffset + archives.size() * sizeof(CatalogArchive);
+	header.sortedOffset = header.recordsOffset + records.size() * sizeof(CatalogRecord);
+	header.metadataOffset = header.sortedOffset + sorted.size() * sizeof(uint32_t);
+	header.stringsOffset = header.metadataOffset + metadata.size() * sizeof(uint32_t);
+	header.stringsSize = strings.size();
+
+	std::vector<unsigned char> data(header.stringsOffset + header.stringsSize);
+	memcpy(data.data(), &header, sizeof(header));
+	memcpy(data.data() + header.archivesOffset, archives.data(), archives.size() * sizeof(CatalogArchive));
+	memcpy(data.data() + header.recordsOffset, records.data(), records.size() * sizeof(CatalogRecord));
+	memcpy(data.data() + header.sortedOffset, sorted.data(), sorted.size() * sizeof(uint32_t));
+	memcpy(data.data() + header.metadataOffset, metadata.data(), metadata.size() * sizeof(uint32_t));
+	memcpy(data.data() + header.stringsOffset, strings.data(), strings.size());
+	if(!Journal::writeFileAtomically(catalogPath, data)){
+		LOG(kLogError) << "Could not write catalog at path " << catalogPath;
+		return false;
+	}
+	LOG(kLogInfo) << "Wrote catalog " << catalogPath << " (" << archives.size() << " archives, " << records.size() << " subentries)";
+	return true;
+}
+
+// Answer a query from a catalog: "entry NAME-INDEX", "types", or "missing path/to/upscaled_dir".
+int queryCatalog(const fs::path& catalogPath, const std::vector<std::string>& query){
+	ArchiveCatalog catalog;
+	if(!catalog.open(catalogPath.c_str())){
+		std::cout << "Could not open catalog at path " << catalogPath << std::endl;
+		return -1;
+	}
+	const CatalogRecord* records = catalog.records();
+
+	if(query.size() == 2 && query[0] == "entry"){
+		const size_t separator = query[1].rfind('-');
+		if(separator == std::string::npos){
+			std::cout << "Expected an entry as NAME-INDEX" << std::endl;
+			return -1;
+		}
+		unsigned int index = 0;
+		if(!parseCount(query[1].substr(separator + 1), index)){
+			std::cout << "Expected an entry as NAME-INDEX" << std::endl;
+			return -1;
+		}
+		const auto ids = catalog.findEntry(query[1].substr(0, separator), index);
+		for(const uint32_t* id = ids.first; id != ids.second; ++id){
+			const CatalogRecord& record = records[*id];
+			std::cout << catalog.archivePath(record.archive) << ": " << getResourceTypeName(ResourceType(record.type)) << ", face " << int(record.face);
+			std::cout << ", offset:" << record.offset << ", size:" << record.size << std::endl;
+		}
+		std::cout << (ids.second - ids.first) << " subentries found." << std::endl;
+		return 0;
+	}
+
+	if(query.size() == 1 && query[0] == "types"){
+		std::map<uint32_t, std::pair<size_t, uint64_t>> types;
+		for(uint32_t i = 0; i < catalog.recordCount(); ++i){
+			if(records[i].flags & kCatalogHasData){
+				std::pair<size_t, uint64_t>& total = types[records[i].type];
+				++total.first;
+				total.second += records[i].size;
+			}
+		}
+		for(const auto& type : types){
+			std::cout << getResourceTypeName(ResourceType(type.first)) << ": " << type.second.first << " blobs, " << type.second.second << " bytes" << std::endl;
+		}
+		return 0;
+	}
+
+	if(query.size() == 2 && query[0] == "missing"){
+		size_t missingCount = 0;
+		for(uint32_t i = 0; i < catalog.recordCount(); ++i){
+			const CatalogRecord& record = records[i];
+			const std::string entryFullName = record.entryName() + "-" + std::to_string(record.index);
+			const std::string fileStem = (record.flags & kCatalogHasData) ? getSubEntryFileStem(entryFullName, ResourceType(record.type), record.face) : "";
+			if(fileStem.empty()){
+				continue;
+			}
+			const fs::path upscaledPath = getUpscaledArchivePath(query[1], catalog.archivePath(record.archive)) / (fileStem + "-edit.jpeg");
+			if(!fs::exists(upscaledPath)){
+				std::cout << upscaledPath.generic_string() << std::endl;
+				++missingCount;
+			}
+		}
+		std::cout << missingCount << " upscaled images missing." << std::endl;
+		return 0;
+	}
+
+	std::cout << "Unknown query, expected: entry NAME-INDEX, types, missing path/to/upscaled_dir" << std::endl;
+	return -1;
+}
+
+// Compare a file with a blob, without reading files of a different size.
+bool isSameFile(const fs::path& path, const BlobSpan& blob){
+	std::error_code error;
+	if(fs::file_size(path, error) != blob.size || error){
+		return false;
+	}
+	std::vector<unsigned char> data;
+	return readFile(path, data) && std::equal(data.begin(), data.end(), blob.begin());
+}
+
+// Write the original images of archives in the upscaled directory layout, using the same naming as the packer.
+bool extractArchives(Context& context, const std::vector<fs::path>& relativeFiles){
+	const Settings& settings = context.settings;
+	TaskScheduler& scheduler = *context.scheduler;
+	std::vector<LogBuffer> logs(relativeFiles.size());
+	std::vector<char> extracted(relativeFiles.size(), 0);
+	std::atomic<size_t> writtenCount{0};
+	std::atomic<size_t> identicalCount{0};
+
+	TaskGroup group;
+	for(size_t i = 0; i < relativeFiles.size(); ++i){
+		scheduler.spawn(group, [&, i](){
+			const fs::path filePath = settings.inputDir / relativeFiles[i];
+			ArchiveReader reader;
+			if(!reader.open(filePath.string(), settings.expectNames)){
+				LOG_TO(logs[i], kLogError) << "Could not open file at path " << filePath;
+				return;
+			}
+			const fs::path upscaledArchivePath = getUpscaledArchivePath(settings.upscaledDir, relativeFiles[i]);
+			std::error_code error;
+			fs::create_directories(upscaledArchivePath, error);
+
+			const FlatDirectory& directory = reader.directory;
+			std::atomic<size_t> failedCount{0};
+			scheduler.parallelFor(0, directory.subEntryCount(), 8, [&](size_t first, size_t last){
+				BlobSpan blob;
+				for(uint32_t subEntry = first; subEntry < last; ++subEntry){
+					const uint32_t entry = directory.entryIds[subEntry];
+					const std::string entryFullName = reader.entryName(entry) + "-" + std::to_string(directory.indices[entry]);
+					const std::string fileStem = getSubEntryFileStem(entryFullName, directory.type(subEntry), directory.faces[subEntry]);
+					if(fileStem.empty() || directory.sizes[subEntry] == 0){
+						continue;
+					}
+					const fs::path outputPath = upscaledArchivePath / (fileStem + ".jpeg");
+					if(!reader.read(subEntry, blob)){
+						++failedCount;
+						continue;
+					}
+					if(isSameFile(outputPath, blob)){
+						++identicalCount;
+						continue;
+					}
+					if(!Journal::writeFileAtomically(outputPath, blob.data, blob.size)){
+						++failedCount;
+						continue;
+					}
+					++writtenCount;
+				}
+			});
+			if(failedCount != 0){
+				LOG_TO(logs[i], kLogError) << "Could not extract " << failedCount << " images from " << filePath;
+				return;
+			}
+			LOG_TO(logs[i], kLogInfo) << "Extracted " << filePath << " to " << upscaledArchivePath;
+			extracted[i] = 1;
+		});
+	}
+	scheduler.wait(group);
+
+	bool success = true;
+	for(size_t i = 0; i < relativeFiles.size(); ++i){
+		logger().write(logs[i]);
+		success = success && extracted[i];
+	}
+	LOG(kLogInfo) << "Wrote " << writtenCount << " images, " << identicalCount << " already present.";
+	return success;
+}
+
+// Edited image compared to the original blob it replaces.
+struct FidelityResult {
+	std::string archive;
+	std::string file;
+	double psnr{0.0};
+	double ssim{0.0};
+	std::string status; // empty if the comparison could be done at the packer scale.
+	bool measured{false}; // false if either image could not be read or decoded.
+};
+
+// Average each block of factorX x factorY pixels.
+void downsampleBox(const unsigned char* src, int srcWidth, int factorX, int factorY, unsigned char* dst, int dstWidth, int dstHeight){
+	const uint32_t area = factorX * factorY;
+	std::vector<uint32_t> sums(size_t(dstWidth) * kImageChannels);
+	for(int y = 0; y < dstHeight; ++y){
+		std::fill(sums.begin(), sums.end(), 0);
+		for(int dy = 0; dy < factorY; ++dy){
+			const unsigned char* srcRow = src + size_t(y * factorY + dy) * srcWidth * kImageChannels;
+			for(int x = 0; x < dstWidth; ++x){
+				for(int dx = 0; dx < factorX; ++dx){
+					const unsigned char* pixel = srcRow + size_t(x * factorX + dx) * kImageChannels;
+					for(int c = 0; c < kImageChannels; ++c){
+						sums[x * kImageChannels + c] += pixel[c];
+					}
+				}
+			}
+		}
+		unsigned char* dstRow = dst + size_t(y) * dstWidth * kImageChannels;
+		for(size_t i = 0; i < sums.size(); ++i){
+			dstRow[i] = (unsigned char)((sums[i] + area / 2) / area);
+		}
+	}
+}
+
+// Peak signal to noise ratio over all channels, capped for identical images.
+double computePSNR(const unsigned char* a, const unsigned char* b, size_t count){
+	// Integer accumulation in a branchless loop, vectorized by the compiler.
+	uint64_t sum = 0;
+	for(size_t i = 0; i < count; ++i){
+		const int32_t diff = int32_t(a[i]) - int32_t(b[i]);
+		sum += uint32_t(diff * diff);
+	}
+	if(sum == 0 || count == 0){
+		return 99.0;
+	}
+	const double mse = double(sum) / double(count);
+	return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+// Mean structural similarity of the luma, over blocks of 8x8 pixels.
+// Luma is rounded to 8 bits so that block sums and cross-products accumulate exactly in uint32_t
+// (at most 64 * 255 * 255), which GCC and Clang vectorize at -O3 (or -O2 from GCC 12 on);
+// float accumulators would only be reordered into vectors with -ffast-math.
+double computeSSIM(const unsigned char* a, const unsigned char* b, int width, int height){
+	const int kBlockSize = 8;
+	const double c1 = (0.01 * 255.0) * (0.01 * 255.0);
+	const double c2 = (0.03 * 255.0) * (0.03 * 255.0);
+	const size_t pixelCount = size_t(width) * height;
+	std::vector<uint8_t> lumaA(pixelCount);
+	std::vector<uint8_t> lumaB(pixelCount);
+	// BT.601 weights in 8-bit fixed point.
+	for(size_t i = 0; i < pixelCount; ++i){
+		lumaA[i] = uint8_t((77u * a[3 * i] + 150u * a[3 * i + 1] + 29u * a[3 * i + 2] + 128u) >> 8);
+		lumaB[i] = uint8_t((77u * b[3 * i] + 150u * b[3 * i + 1] + 29u * b[3 * i + 2] + 128u) >> 8);
+	}
+	double total = 0.0;
+	size_t blockCount = 0;
+	for(int y0 = 0; y0 < height; y0 += kBlockSize){
+		for(int x0 = 0; x0 < width; x0 += kBlockSize){
+			const int w = std::min(kBlockSize, width - x0);
+			const int h = std::min(kBlockSize, height - y0);
+			uint32_t sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
+			for(int y = y0; y < y0 + h; ++y){
+				const uint8_t* rowA = &lumaA[size_t(y) * width + x0];
+				const uint8_t* rowB = &lumaB[size_t(y) * width + x0];
+				for(int x = 0; x < w; ++x){
+					const uint32_t la = rowA[x];
+					const uint32_t lb = rowB[x];
+					sumA += la;
+					sumB += lb;
+					sumAA += la * la;
+					sumBB += lb * lb;
+					sumAB += la * lb;
+				}
+			}
+			const double n = double(w * h);
+			const double meanA = sumA / n;
+			const double meanB = sumB / n;
+			const double varA = std::max(0.0, sumAA / n - meanA * meanA);
+			const double varB = std::max(0.0, sumBB / n - meanB * meanB);
+			const double covariance = sumAB / n - meanA * meanB;
+			total += ((2.0 * meanA * meanB + c1) * (2.0 * covariance + c2)) / ((meanA * meanA + meanB * meanB + c1) * (varA + varB + c2));
+			++blockCount;
+		}
+	}
+	return blockCount == 0 ? 1.0 : total / double(blockCount);
+}
+
+// Bring the edited image back to the original resolution and compare them.
+void compareFidelity(const BlobSpan& original, const std::vector<unsigned char>& edited, FidelityResult& result){
+	int w, h, ew, eh, c;
+	std::unique_ptr<stbi_uc, void(*)(void*)> originalImg(stbi_load_from_memory(original.data, original.size, &w, &h, &c, kImageChannels), stbi_image_free);
+	std::unique_ptr<stbi_uc, void(*)(void*)> editedImg(stbi_load_from_memory(edited.data(), edited.size(), &ew, &eh, &c, kImageChannels), stbi_image_free);
+	if(!originalImg || !editedImg){
+		result.status = "undecodable";
+		return;
+	}
+	std::vector<unsigned char> downsampled(size_t(w) * h * kImageChannels);
+	if(ew % w == 0 && eh % h == 0 && ew / w == eh / h){
+		downsampleBox(editedImg.get(), ew, ew / w, eh / h, downsampled.data(), w, h);
+	} else {
+		stbir_resize_uint8(editedImg.get(), ew, eh, 0, downsampled.data(), w, h, 0, kImageChannels);
+	}
+	if(ew != UPSCALE_FACTOR * w || eh != UPSCALE_FACTOR * h){
+		result.status = "resolution " + std::to_string(ew) + "x" + std::to_string(eh) + " for " + std::to_string(w) + "x" + std::to_string(h);
+	}
+	result.psnr = computePSNR(originalImg.get(), downsampled.data(), downsampled.size());
+	result.ssim = computeSSIM(originalImg.get(), downsampled.data(), w, h);
+	result.measured = true;
+}
+
+// Compare each edited image to the original it replaces, and list the least similar ones first.
+bool checkFidelity(Context& context, const std::vector<fs::path>& relativeFiles){
+	const Settings& settings = context.settings;
+	const double kMinSSIM = 0.8;
+
+	struct Comparison {
+		const ArchiveReader* reader;
+		uint32_t subEntry;
+		fs::path editPath;
+		std::string archive;
+	};
+	std::vector<std::unique_ptr<ArchiveReader>> readers;
+	std::vector<Comparison> comparisons;
+	for(const fs::path& relativeFile : relativeFiles){
+		const fs::path filePath = settings.inputDir / relativeFile;
+		readers.emplace_back(new ArchiveReader());
+		const ArchiveReader& reader = *readers.back();
+		if(!readers.back()->open(filePath.string(), settings.expectNames)){
+			LOG(kLogError) << "Could not open file at path " << filePath;
+			return false;
+		}
+		const fs::path upscaledArchivePath = getUpscaledArchivePath(settings.upscaledDir, relativeFile);
+		const FlatDirectory& directory = reader.directory;
+		for(uint32_t subEntry = 0; subEntry < directory.subEntryCount(); ++subEntry){
+			const uint32_t entry = directory.entryIds[subEntry];
+			const std::string entryFullName = reader.entryName(entry) + "-" + std::to_string(directory.indices[entry]);
+			const std::string fileStem = getSubEntryFileStem(entryFullName, directory.type(subEntry), directory.faces[subEntry]);
+			const fs::path editPath = upscaledArchivePath / (fileStem + "-edit.jpeg");
+			if(fileStem.empty() || directory.sizes[subEntry] == 0 || !fs::exists(editPath)){
+				continue;
+			}
+			comparisons.push_back({ &reader, subEntry, editPath, relativeFile.generic_string() });
+		}
+	}
+
+	std::vector<FidelityResult> results(comparisons.size());
+	context.scheduler->parallelFor(0, comparisons.size(), 1, [&](size_t first, size_t last){
+		for(size_t i = first; i < last; ++i){
+			const Comparison& comparison = comparisons[i];
+			FidelityResult& result = results[i];
+			result.archive = comparison.archive;
+			result.file = comparison.editPath.filename().string();
+			BlobSpan original;
+			std::vector<unsigned char> edited;
+			if(!comparison.reader->read(comparison.subEntry, original) || !readFile(comparison.editPath, edited)){
+				result.status = "unreadable";
+				continue;
+			}
+			compareFidelity(original, edited, result);
+		}
+	});
+
+	// Failures first, then by increasing similarity.
+	std::sort(results.begin(), results.end(), [](const FidelityResult& a, const FidelityResult& b){
+		const bool aCompared = a.status.empty();
+		const bool bCompared = b.status.empty();
+		if(aCompared != bCompared){
+			return !aCompared;
+		}
+		return a.ssim < b.ssim || (a.ssim == b.ssim && std::tie(a.archive, a.file) < std::tie(b.archive, b.file));
+	});
+	double psnrSum = 0.0;
+	double ssimSum = 0.0;
+	size_t lowCount = 0;
+	size_t issueCount = 0;
+	size_t measuredCount = 0;
+	for(const FidelityResult& result : results){
+		issueCount += result.status.empty() ? 0 : 1;
+		if(!result.measured){
+			continue;
+		}
+		psnrSum += result.psnr;
+		ssimSum += result.ssim;
+		lowCount += result.ssim < kMinSSIM ? 1 : 0;
+		++measuredCount;
+	}
+
+	if(!settings.reportPath.empty()){
+		std::ofstream reportFile(settings.reportPath);
+		reportFile << "archive\tfile\tpsnr\tssim\tstatus" << "\n";
+		for(const FidelityResult& result : results){
+			reportFile << result.archive << "\t" << result.file << "\t" << result.psnr << "\t" << result.ssim << "\t" << (result.status.empty() ? "ok" : result.status) << "\n";
+		}
+		if(!reportFile){
+			LOG(kLogError) << "Could not write report at path " << settings.reportPath;
+		}
+	}
+
+	LOG(kLogInfo) << "Compared " << results.size() << " edited images: " << issueCount << " with issues, " << lowCount << " with SSIM below " << kMinSSIM;
+	if(measuredCount != 0){
+		LOG(kLogInfo) << "Average PSNR " << psnrSum / double(measuredCount) << "dB, average SSIM " << ssimSum / double(measuredCount)
+			<< (measuredCount != results.size() ? " over " + std::to_string(measuredCount) + " measured images" : "");
+	}
+	for(size_t i = 0; i < std::min(results.size(), settings.outliers); ++i){
+		const FidelityResult& result = results[i];
+		if(!result.measured){
+			LOG(kLogInfo) << "\t* " << result.archive << ": " << result.file << ": " << result.status;
+			continue;
+		}
+		LOG(kLogInfo) << "\t* " << result.archive << ": " << result.file << ": PSNR " << result.psnr << "dB, SSIM " << result.ssim << (result.status.empty() ? "" : " (" + result.status + ")");
+	}
+	return true;
+}
+
+const int kWatchDebounceMs = 500;
+
+// Watch a directory and all its subdirectories, listing the ones added.
+void addWatches(int fd, const fs::path& directory, std::unordered_map<int, fs::path>& watchedDirs, std::vector<fs::path>& addedDirs){
+	const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR;
+	const int wd = inotify_add_watch(fd, directory.c_str(), mask);
+	if(wd < 0){
+		LOG(kLogError) << "Could not watch directory " << directory;
+		return;
+	}
+	watchedDirs[wd] = directory;
+	addedDirs.push_back(directory);
+	std::error_code error;
+	for(const fs::directory_entry& item : fs::directory_iterator(directory, error)){
+		if(item.is_directory(error)){
+			addWatches(fd, item.path(), watchedDirs, addedDirs);
+		}
+	}
+}
+
+// Repack archives when their upscaled images change. Changes are grouped until no event
+// is received for a short time, fallback upscales of unchanged images come from the cache.
+void watchUpscaledFiles(Context& context, const std::vector<fs::path>& relativeFiles){
+	const Settings& settings = context.settings;
+	const std::string editSuffix = "-edit.jpeg";
+
+	// Map the upscaled directory of each archive back to it.
+	std::unordered_map<std::string, fs::path> archivesByDir;
+	for(const fs::path& relativeFile : relativeFiles){
+		archivesByDir[getUpscaledArchivePath(settings.upscaledDir, relativeFile).lexically_normal().generic_string()] = relativeFile;
+	}
+	std::set<fs::path> affected;
+	auto markDirectory = [&](const fs::path& directory){
+		auto archive = archivesByDir.find(directory.lexically_normal().generic_string());
+		if(archive != archivesByDir.end()){
+			affected.insert(archive->second);
+		}
+	};
+
+	const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0){
+		LOG(kLogError) << "Could not watch upscaled directory (" << strerror(errno) << ")";
+		return;
+	}
+	std::error_code error;
+	fs::create_directories(settings.upscaledDir, error);
+	std::unordered_map<int, fs::path> watchedDirs;
+	std::vector<fs::path> addedDirs;
+	addWatches(fd, settings.upscaledDir, watchedDirs, addedDirs);
+	LOG(kLogInfo) << "Watching " << settings.upscaledDir << " for changes (" << watchedDirs.size() << " directories)";
+
+	alignas(inotify_event) char buffer[4096];
+	while(true){
+		// Block until a change occurs, then wait for the burst to end.
+		pollfd pollFd = { fd, POLLIN, 0 };
+		const int res = poll(&pollFd, 1, affected.empty() ? -1 : kWatchDebounceMs);
+		if(res < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		if(res == 0){
+			const std::vector<fs::path> archives(affected.begin(), affected.end());
+			affected.clear();
+			LOG(kLogInfo) << "Repacking " << archives.size() << " archive(s) after changes";
+			if(!processArchives(context, archives, true)){
+				LOG(kLogError) << "Could not repack all archives, waiting for further changes";
+			}
+			continue;
+		}
+
+		ssize_t length;
+		while((length = read(fd, buffer, sizeof(buffer))) > 0){
+			for(char* ptr = buffer; ptr < buffer + length; ){
+				const inotify_event* event = (const inotify_event*)ptr;
+				ptr += sizeof(inotify_event) + event->len;
+
+				auto watchedDir = watchedDirs.find(event->wd);
+				if(watchedDir == watchedDirs.end()){
+					continue;
+				}
+				if(event->mask & IN_IGNORED){
+					watchedDirs.erase(watchedDir);
+					continue;
+				}
+				if(event->len == 0){
+					continue;
+				}
+				const fs::path directory = watchedDir->second;
+				const std::string name(event->name);
+				if(event->mask & IN_ISDIR){
+					// Images may have been added to the new directories before they were watched.
+					const fs::path path = directory / name;
+					if(event->mask & (IN_CREATE | IN_MOVED_TO)){
+						addedDirs.clear();
+						addWatches(fd, path, watchedDirs, addedDirs);
+						for(const fs::path& addedDir : addedDirs){
+							markDirectory(addedDir);
+						}
+					} else {
+						markDirectory(path);
+					}
+				} else if(name.size() > editSuffix.size() && name.compare(name.size() - editSuffix.size(), editSuffix.size(), editSuffix) == 0
+					&& !context.ownWrites.contains(directory / name)){
+					markDirectory(directory);
+				}
+			}
+		}
+	}
+	close(fd);
+}
+
+// Check the layout of archives in the input directory: the header decodes to a directory whose
+// blobs are inside the file and only overlap when shared.
+bool verifyArchives(Context& context, const std::vector<fs::path>& relativeFiles){
+	const Settings& settings = context.settings;
+	context.report.reset(new RunReport());
+	bool success = true;
+	for(const fs::path& relativeFile : relativeFiles){
+		Archive archive;
+		archive.relativeFile = relativeFile;
+		LogBuffer log;
+		const bool loaded = loadArchive(context, archive, log);
+		logger().write(log);
+		success = loaded && verifyWrittenArchive(context, archive, settings.inputDir / relativeFile, true) && success;
+		releaseArchiveData(context, archive);
+	}
+	LOG(kLogInfo) << "Verified " << context.report->verified << " archive(s), " << context.report->verifyFailures << " failed.";
+	return success;
+}
+
+// List the subentries of archives, from the catalog when it contains them, or of an entry in all cataloged archives.
+bool listArchives(Context& context, const ArchiveCatalog* catalog, const std::vector<fs::path>& relativeFiles, const std::string& entry){
+	const Settings& settings = context.settings;
+	auto logSubEntry = [](const std::string& archivePath, const std::string& entryFullName, ResourceType type, int face, uint32_t size){
+		LOG(kLogInfo) << archivePath << ": " << entryFullName << ", " << getResourceTypeName(type) << ", face " << face << ", size " << size;
+	};
+	if(!entry.empty()){
+		const size_t separator = entry.rfind('-');
+		const std::string indexStr = separator == std::string::npos ? "" : entry.substr(separator + 1);
+		char* indexEnd = nullptr;
+		const unsigned long index = strtoul(indexStr.c_str(), &indexEnd, 10);
+		if(!catalog || indexStr.empty() || *indexEnd != '\0' || index > UINT32_MAX){
+			LOG(kLogError) << "Listing an entry requires a catalog and an entry as NAME-INDEX";
+			return false;
+		}
+		const auto ids = catalog->findEntry(entry.substr(0, separator), uint32_t(index));
+		for(const uint32_t* id = ids.first; id != ids.second; ++id){
+			const CatalogRecord& record = catalog->records()[*id];
+			logSubEntry(catalog->archivePath(record.archive), entry, ResourceType(record.type), record.face, (record.flags & kCatalogHasData) ? record.size : 0);
+		}
+		return true;
+	}
+
+	std::unordered_map<std::string, uint32_t> catalogArchives;
+	for(uint32_t i = 0; catalog && i < catalog->archiveCount(); ++i){
+		catalogArchives[catalog->archivePath(i)] = i;
+	}
+	for(const fs::path& relativeFile : relativeFiles){
+		const std::string archivePath = relativeFile.generic_string();
+		auto cataloged = catalogArchives.find(archivePath);
+		if(cataloged != catalogArchives.end()){
+			const CatalogArchive& item = catalog->archive(cataloged->second);
+			for(uint32_t id = item.firstRecord; id < item.firstRecord + item.recordCount; ++id){
+				const CatalogRecord& record = catalog->records()[id];
+				logSubEntry(archivePath, record.entryName() + "-" + std::to_string(record.index), ResourceType(record.type), record.face, (record.flags & kCatalogHasData) ? record.size : 0);
+			}
+			continue;
+		}
+		ArchiveReader reader;
+		if(!reader.open((settings.inputDir / relativeFile).string(), settings.expectNames)){
+			LOG(kLogError) << "Could not open file at path " << settings.inputDir / relativeFile;
+			return false;
+		}
+		const FlatDirectory& directory = reader.directory;
+		for(uint32_t subEntry = 0; subEntry < directory.subEntryCount(); ++subEntry){
+			const uint32_t entryId = directory.entryIds[subEntry];
+			const uint32_t size = storesData(directory.type(subEntry)) ? directory.sizes[subEntry] : 0;
+			logSubEntry(archivePath, reader.entryName(entryId) + "-" + std::to_string(directory.indices[entryId]), directory.type(subEntry), directory.faces[subEntry], size);
+		}
+	}
+	return true;
+}
+
+// A directory given by a request, relative to the daemon one, which it must not leave once symlinks are resolved.
+bool resolveRequestDir(const LocalMessage& request, const std::string& key, const fs::path& baseDir, fs::path& dir){
+	dir = baseDir;
+	const std::string value = request.value(key);
+	if(value.empty()){
+		return true;
+	}
+	std::error_code ec;
+	const fs::path canonicalBase = fs::weakly_canonical(baseDir, ec);
+	if(!ec){
+		dir = fs::weakly_canonical(canonicalBase / value, ec);
+	}
+	const fs::path relativePath = dir.lexically_relative(canonicalBase);
+	if(ec || relativePath.empty() || *relativePath.begin() == ".."){
+		LOG(kLogError) << "Directory " << value << " is outside of " << baseDir;
+		return false;
+	}
+	return true;
+}
+
+// Daemon mode: requests of local clients are handled one at a time, sharing the scheduler threads,
+// the cache of upscaled blobs and the catalog. A request is a JSON object on one line:
+// {"command": "pack" | "extract" | "list" | "verify" | "stop", "archives": [...], "entry": "NAME-INDEX"},
+// with optional "input", "upscaled" and "output" directories, relative to and inside those of the daemon.
+// Its messages are sent back as JSON lines while it runs, followed by a status line with "done".
+bool handleRequest(Context& context, const Settings& baseSettings, const ArchiveCatalog* catalog, const LocalMessage& request){
+	Settings& settings = context.settings;
+	settings = baseSettings;
+	if(!resolveRequestDir(request, "input", baseSettings.inputDir, settings.inputDir)
+	   || !resolveRequestDir(request, "upscaled", baseSettings.upscaledDir, settings.upscaledDir)
+	   || !resolveRequestDir(request, "output", baseSettings.outputDir, settings.outputDir)){
+		return false;
+	}
+	const std::string command = request.value("command");
+	if(command == "verify"){
+		// Written archives are checked in place.
+		settings.inputDir = settings.outputDir;
+	}
+	std::vector<fs::path> relativeFiles;
+	for(const std::string& archive : request.list("archives")){
+		const fs::path inputPath = (settings.inputDir / archive).lexically_normal();
+		// Archives are written at the same relative path in the output directory, which they must not leave.
+		const fs::path relativePath = inputPath.lexically_relative(settings.inputDir.lexically_normal());
+		if(archive.empty() || relativePath.empty() || *relativePath.begin() == ".."){
+			LOG(kLogError) << "Archive " << archive << " is outside of " << settings.inputDir;
+			return false;
+		}
+		if(!fs::exists(inputPath)){
+			LOG(kLogError) << "No archive at path " << inputPath;
+			return false;
+		}
+		collectInputFiles(settings.inputDir, inputPath, relativeFiles);
+	}
+
+	if(command == "pack"){
+		return processArchives(context, relativeFiles, true);
+	}
+	if(command == "extract"){
+		return extractArchives(context, relativeFiles);
+	}
+	if(command == "verify"){
+		return verifyArchives(context, relativeFiles);
+	}
+	if(command == "list"){
+		return listArchives(context, catalog, relativeFiles, request.value("entry"));
+	}
+	LOG(kLogError) << "Unknown command " << command;
+	return false;
+}
+
+const int kClientTimeoutMs = 10000;
+
+int serveRequests(Context& context, const fs::path& socketPath, const fs::path& catalogPath){
+	std::unique_ptr<ArchiveCatalog> catalog;
+	if(!catalogPath.empty()){
+		catalog.reset(new ArchiveCatalog());
+		if(!catalog->open(catalogPath.c_str())){
+			LOG(kLogError) << "Could not open catalog at path " << catalogPath;
+			return -1;
+		}
+	}
+	const int serverFd = listenLocal(socketPath.string());
+	if(serverFd < 0){
+		LOG(kLogError) << "Could not listen on socket at path " << socketPath << " (" << strerror(errno) << ")";
+		return -1;
+	}
+	// Clients may disconnect while messages are sent to them.
+	signal(SIGPIPE, SIG_IGN);
+	const Settings baseSettings = context.settings;
+	LOG(kLogInfo) << "Listening on " << socketPath;
+
+	bool stop = false;
+	while(!stop){
+		const int clientFd = accept(serverFd, nullptr, nullptr);
+		if(clientFd < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			LOG(kLogError) << "Could not accept connection (" << strerror(errno) << ")";
+			break;
+		}
+		// A silent or stalled client doesn't block the daemon for longer than this.
+		setSocketTimeouts(clientFd, kClientTimeoutMs);
+		std::string pending;
+		std::string line;
+		LocalMessage request;
+		if(!readLine(clientFd, pending, line) || !request.parse(line)){
+			writeAll(clientFd, "{\"done\":true,\"success\":false,\"error\":\"invalid request\"}\n");
+			close(clientFd);
+			continue;
+		}
+		LOG(kLogInfo) << "Request: " << line;
+		const auto start = std::chrono::steady_clock::now();
+		bool success = true;
+		if(request.value("command") == "stop"){
+			stop = true;
+		} else {
+			FILE* clientFile = fdopen(dup(clientFd), "w");
+			if(clientFile){
+				// Messages already queued still go to the daemon output.
+				FILE* daemonOutput = logger().redirect(clientFile);
+				const bool json = logger().json;
+				logger().json = true;
+				// A failing request must not stop the daemon.
+				try {
+					success = handleRequest(context, baseSettings, catalog.get(), request);
+				} catch(const std::exception& error){
+					LOG(kLogError) << "Request failed: " << error.what();
+					success = false;
+				}
+				logger().redirect(daemonOutput);
+				logger().json = json;
+				fclose(clientFile);
+			} else {
+				success = false;
+			}
+		}
+		const uint64_t durationMs = elapsedNs(start) / 1000000;
+		writeAll(clientFd, std::string("{\"done\":true,\"success\":") + (success ? "true" : "false") + ",\"time_ms\":" + std::to_string(durationMs) + "}\n");
+		close(clientFd);
+		LOG(kLogInfo) << "Request " << (success ? "done" : "failed") << " in " << durationMs << "ms";
+	}
+	close(serverFd);
+	unlink(socketPath.c_str());
+	context.settings = baseSettings;
+	return 0;
+}
+
+// Send a request to a daemon and print the messages sent back, until the status line.
+int sendRequest(const fs::path& socketPath, const std::string& request){
+	const int fd = connectLocal(socketPath.string());
+	if(fd < 0){
+		std::cout << "Could not connect to socket at path " << socketPath << std::endl;
+		return -1;
+	}
+	bool success = false;
+	if(writeAll(fd, request + "\n")){
+		std::string pending;
+		std::string line;
+		while(readLine(fd, pending, line)){
+			std::cout << line << std::endl;
+			LocalMessage status;
+			if(status.parse(line) && status.value("done") == "true"){
+				success = status.value("success") == "true";
+				break;
+			}
+		}
+	}
+	close(fd);
+	return success ? 0 : -1;
+}
+
+// Size in bytes, with an optional K, M or G binary suffix.
+// Returns false for anything else than digits and an optional suffix.
+bool parseByteSize(const std::string& str, uint64_t& size){
+	if(str.empty() || !std::isdigit((unsigned char)str[0])){
+		return false;
+	}
+	char* end = nullptr;
+	errno = 0;
+	const unsigned long long value = strtoull(str.c_str(), &end, 10);
+	if(errno == ERANGE){
+		return false;
+	}
+	uint64_t multiplier = 1;
+	if(*end != '\0'){
+		const char suffix = std::toupper((unsigned char)*end);
+		if(suffix == 'K'){
+			multiplier = 1024ull;
+		} else if(suffix == 'M'){
+			multiplier = 1024ull * 1024ull;
+		} else if(suffix == 'G'){
+			multiplier = 1024ull * 1024ull * 1024ull;
+		} else {
+			return false;
+		}
+		if(*(end + 1) != '\0'){
+			return false;
+		}
+	}
+	if(value > UINT64_MAX / multiplier){
+		return false;
+	}
+	size = uint64_t(value) * multiplier;
+	return true;
+}
+
+int main(int argc, char** argv){
+
+	const std::string command = argc > 1 ? argv[1] : "";
+	if(command == "-query" && argc >= 4){
+		return queryCatalog(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+	}
+	if(command == "-send" && argc >= 4){
+		return sendRequest(argv[2], argv[3]);
+	}
+	if(command == "-merge" && argc >= 4){
+		return mergeShardFiles(argv[2], std::vector<fs::path>(argv + 3, argv + argc)) ? 0 : -1;
+	}
+	const bool compact = command == "-compact" && argc >= 4;
+	const bool catalog = command == "-catalog" && argc >= 5;
+	const bool extract = command == "-extract" && argc >= 5;
+	const bool check = command == "-check" && argc >= 5;
+	const bool serve = command == "-serve" && argc >= 6;
+	if(argc < 5 && !compact){
+		std::cout << "executable path/to/input_dir path/to/upscaled_dir path/to/output_dir input_dir/subpath/to/nodes.m3a [more archives or directories...] [-names] [-passthrough] [-no-share] [-update] [-verify] [-incremental] [-watch] [-cache-size N[K|M|G]] [-threads N] [-stage-workers read=N,decode=N,resize=N,encode=N,write=N] [-queue-size N] [-max-memory N[K|M|G]] [-io uring|threads] [-io-depth N] [-journal path/to/journal] [-report path/to/report] [-shard i/N] [-trace path/to/trace.json] [-memory-report] [-quiet | -verbose | -log-level error|warning|info|verbose] [-log-json] [-upscaler \"command\"] [-upscaler-jobs N] [-upscaler-batch N]" << std::endl;
+		std::cout << "executable -compact path/to/output_dir output_dir/subpath/to/nodes.m3a [more archives or directories...] [-names] [-no-share] [-verify]" << std::endl;
+		std::cout << "executable -catalog path/to/catalog path/to/input_dir input_dir/subpath/to/nodes.m3a [more archives or directories...] [-names]" << std::endl;
+		std::cout << "executable -extract path/to/input_dir path/to/upscaled_dir input_dir/subpath/to/nodes.m3a [more archives or directories...] [-names] [-threads N]" << std::endl;
+		std::cout << "executable -check path/to/input_dir path/to/upscaled_dir input_dir/subpath/to/nodes.m3a [more archives or directories...] [-names] [-threads N] [-report path/to/report.tsv] [-outliers N]" << std::endl;
+		std::cout << "executable -serve path/to/socket path/to/input_dir path/to/upscaled_dir path/to/output_dir [-catalog path/to/catalog] [same options as above]" << std::endl;
+		std::cout << "executable -send path/to/socket '{\"command\": \"pack\" | \"extract\" | \"list\" | \"verify\" | \"stop\", \"archives\": [\"input_dir/subpath/to/nodes.m3a\", ...]}'" << std::endl;
+		std::cout << "executable -merge path/to/merged_file path/to/shard_journal_report_or_fingerprints [more files of the same kind...]" << std::endl;
+		std::cout << "executable -query path/to/catalog entry NAME-INDEX | types | missing path/to/upscaled_dir" << std::endl;
+		return 0;
+	}
+
+	Context context;
+	Settings& settings = context.settings;
+	fs::path journalPath;
+	fs::path catalogPath;
+	fs::path socketPath;
+	settings.threads = std::max(1u, std::thread::hardware_concurrency());
+	std::string stageWorkers;
+	std::vector<fs::path> inputPaths;
+	int firstOption;
+	if(compact){
+		// Archives are rewritten in place.
+		settings.inputDir = settings.outputDir = argv[2];
+		inputPaths.push_back(argv[3]);
+		firstOption = 4;
+	} else if(catalog){
+		catalogPath = argv[2];
+		settings.inputDir = argv[3];
+		inputPaths.push_back(argv[4]);
+		firstOption = 5;
+	} else if(serve){
+		socketPath = argv[2];
+		settings.inputDir = argv[3];
+		settings.upscaledDir = argv[4];
+		settings.outputDir = argv[5];
+		firstOption = 6;
+		// Results are kept for the next requests.
+		context.cache.enabled = true;
+	} else if(extract || check){
+		settings.inputDir = argv[2];
+		settings.upscaledDir = argv[3];
+		inputPaths.push_back(argv[4]);
+		firstOption = 5;
+	} else {
+		settings.inputDir = argv[1];
+		settings.upscaledDir = argv[2];
+		settings.outputDir = argv[3];
+		inputPaths.push_back(argv[4]);
+		firstOption = 5;
+	}
+
+	for(int i = firstOption; i < argc; ++i){
+		std::string arg(argv[i]);
+		// Also accept double dash options.
+		if(arg.compare(0, 2, "--") == 0){
+			arg.erase(0, 1);
+		}
+		const bool hasValue = i + 1 < argc;
+		if(arg == "-names"){
+			settings.expectNames = true;
+		} else if(arg == "-passthrough"){
+			settings.passthrough = true;
+		} else if(arg == "-update"){
+			settings.updateInPlace = true;
+		} else if(arg == "-verify"){
+			settings.verify = true;
+		} else if(arg == "-incremental"){
+			settings.incremental = true;
+		} else if(arg == "-watch"){
+			settings.watch = true;
+			context.cache.enabled = true;
+		} else if(arg == "-cache-size" && hasValue){
+			const std::string cacheSize = argv[++i];
+			if(!parseByteSize(cacheSize, context.cache.maxBytes)){
+				LOG(kLogError) << "Invalid cache size " << cacheSize << ", expected N, NK, NM or NG";
+				return -1;
+			}
+		} else if(arg == "-no-share"){
+			settings.shareBlobs = false;
+		} else if(arg == "-threads" && hasValue){
+			if(!parseCount(argv[++i], settings.threads, 1)){
+				LOG(kLogError) << "Invalid thread count " << argv[i] << ", expected a positive number";
+				return -1;
+			}
+		} else if(arg == "-stage-workers" && hasValue){
+			stageWorkers = argv[++i];
+		} else if(arg == "-queue-size" && hasValue){
+			unsigned int queueSize = 0;
+			if(!parseCount(argv[++i], queueSize, 1)){
+				LOG(kLogError) << "Invalid queue size " << argv[i] << ", expected a positive number";
+				return -1;
+			}
+			settings.pipeline.queueSize = queueSize;
+		} else if(arg == "-max-memory" && hasValue){
+			const std::string maxMemory = argv[++i];
+			if(!parseByteSize(maxMemory, settings.pipeline.maxMemory)){
+				LOG(kLogError) << "Invalid memory size " << maxMemory << ", expected N, NK, NM or NG";
+				return -1;
+			}
+		} else if(arg == "-io" && hasValue){
+			const std::string io = argv[++i];
+			if(io != "uring" && io != "threads"){
+				LOG(kLogError) << "Invalid IO backend " << io << ", expected uring or threads";
+				return -1;
+			}
+			settings.io.useRing = io == "uring";
+		} else if(arg == "-io-depth" && hasValue){
+			if(!parseCount(argv[++i], settings.io.queueDepth, 1)){
+				LOG(kLogError) << "Invalid IO depth " << argv[i] << ", expected a positive number";
+				return -1;
+			}
+		} else if(arg == "-journal" && hasValue){
+			journalPath = argv[++i];
+		} else if(arg == "-quiet"){
+			logger().level = kLogError;
+		} else if(arg == "-verbose"){
+			logger().level = kLogVerbose;
+		} else if(arg == "-log-level" && hasValue){
+			const std::string levelName = argv[++i];
+			const auto levelPos = std::find(logLevelNames, logLevelNames + kLogVerbose + 1, levelName);
+			if(levelPos == logLevelNames + kLogVerbose + 1){
+				LOG(kLogError) << "Unknown log level " << levelName;
+				return -1;
+			}
+			logger().level = LogLevel(levelPos - logLevelNames);
+		} else if(arg == "-log-json"){
+			logger().json = true;
+		} else if(arg == "-report" && hasValue){
+			settings.reportPath = argv[++i];
+		} else if(arg == "-catalog" && hasValue){
+			catalogPath = argv[++i];
+		} else if(arg == "-shard" && hasValue){
+			const std::string shard = argv[++i];
+			const size_t separator = shard.find('/');
+			if(separator == std::string::npos
+			   || !parseCount(shard.substr(0, separator), settings.shardIndex)
+			   || !parseCount(shard.substr(separator + 1), settings.shardCount, 1)
+			   || settings.shardIndex >= settings.shardCount){
+				LOG(kLogError) << "Invalid shard " << shard << ", expected i/N with i in [0, N)";
+				return -1;
+			}
+		} else if(arg == "-outliers" && hasValue){
+			unsigned int outliers = 0;
+			if(!parseCount(argv[++i], outliers)){
+				LOG(kLogError) << "Invalid outliers count " << argv[i] << ", expected a number";
+				return -1;
+			}
+			settings.outliers = outliers;
+		} else if(arg == "-memory-report"){
+			settings.memoryReport = true;
+		} else if(arg == "-trace" && hasValue){
+			settings.tracePath = argv[++i];
+			context.trace.enabled = true;
+		} else if(arg == "-upscaler" && hasValue){
+			settings.upscaler.command = argv[++i];
+		} else if(arg == "-upscaler-jobs" && hasValue){
+			if(!parseCount(argv[++i], settings.upscaler.jobs, 1)){
+				LOG(kLogError) << "Invalid upscaler jobs " << argv[i] << ", expected a positive number";
+				return -1;
+			}
+		} else if(arg == "-upscaler-batch" && hasValue){
+			if(!parseCount(argv[++i], settings.upscaler.batch, 1)){
+				LOG(kLogError) << "Invalid upscaler batch " << argv[i] << ", expected a positive number";
+				return -1;
+			}
+		} else if(arg[0] != '-'){
+			inputPaths.push_back(arg);
+		} else {
+			LOG(kLogError) << "Unknown option " << arg << (hasValue ? "" : " or missing value");
+			return -1;
+		}
+	}
+
+	// All stages share the scheduler threads, so compute stages can each use all of them without oversubscribing.
+	const unsigned int threads = settings.threads;
+	settings.pipeline.workers[kStageRead] = 2;
+	settings.pipeline.workers[kStageDecode] = threads;
+	settings.pipeline.workers[kStageResize] = threads;
+	settings.pipeline.workers[kStageEncode] = threads;
+	settings.pipeline.workers[kStageWrite] = 1;
+	settings.io.fallbackThreads = std::max(4u, threads);
+	// Overrides, as a list of stage=count.
+	std::istringstream stageWorkersList(stageWorkers);
+	std::string stageWorker;
+	while(std::getline(stageWorkersList, stageWorker, ',')){
+		const size_t separator = stageWorker.find('=');
+		const auto stageName = std::find(stageNames, stageNames + kStageCount, stageWorker.substr(0, separator));
+		if(separator == std::string::npos || stageName == stageNames + kStageCount){
+			LOG(kLogError) << "Unknown stage in " << stageWorker;
+			return -1;
+		}
+		if(!parseCount(stageWorker.substr(separator + 1), settings.pipeline.workers[stageName - stageNames], 1)){
+			LOG(kLogError) << "Invalid worker count in " << stageWorker << ", expected a positive number";
+			return -1;
+		}
+	}
+
+	std::vector<fs::path> relativeFiles;
+	for(const fs::path& inputPath : inputPaths){
+		collectInputFiles(settings.inputDir, inputPath, relativeFiles);
+	}
+
+	LOG(kLogInfo) << "Using " << (AsyncIO::forThread(settings.io).usesRing() ? "io_uring" : "thread pool") << " for file accesses.";
+
+	// Settings changing the content of output archives. The upscaler command is hashed to fit on one line.
+	char upscalerHash[20];
+	snprintf(upscalerHash, sizeof(upscalerHash), "%016llx", (unsigned long long)hashData((const unsigned char*)settings.upscaler.command.data(), settings.upscaler.command.size()));
+	const std::string settingsKey = "factor=" + std::to_string(UPSCALE_FACTOR)
+		+ " names=" + std::to_string(settings.expectNames)
+		+ " passthrough=" + std::to_string(settings.passthrough)
+		+ " share=" + std::to_string(settings.shareBlobs)
+		+ " upscaler=" + upscalerHash;
+	if(settings.incremental){
+		// Each shard writes its own file, so that concurrent runs don't overwrite the records of each other.
+		const fs::path sharedFingerprintsPath = settings.outputDir / ".m3pack-fingerprints";
+		const fs::path fingerprintsPath = settings.shardCount > 1
+			? fs::path(sharedFingerprintsPath.string() + ".shard-" + std::to_string(settings.shardIndex) + "-of-" + std::to_string(settings.shardCount))
+			: sharedFingerprintsPath;
+		if(!context.fingerprints.open(fingerprintsPath, sharedFingerprintsPath, settingsKey)){
+			LOG(kLogWarning) << "Ignoring fingerprints at path " << fingerprintsPath << " from another version";
+		}
+	}
+	if(!journalPath.empty()){
+		if(!context.journal.open(journalPath, settingsKey)){
+			LOG(kLogError) << "Could not open journal at path " << journalPath;
+			return -1;
+		}
+	}
+
+	context.scheduler.reset(new TaskScheduler(settings.threads));
+	if(settings.memoryReport){
+		memoryTracker().start(std::chrono::milliseconds(20));
+	}
+	if(serve){
+		return serveRequests(context, socketPath, catalogPath);
+	}
+	if(compact){
+		return compactArchives(context, relativeFiles) ? 0 : -1;
+	}
+	if(catalog){
+		return buildCatalog(context, relativeFiles, catalogPath) ? 0 : -1;
+	}
+	if(check){
+		return checkFidelity(context, relativeFiles) ? 0 : -1;
+	}
+	if(settings.shardCount > 1){
+		selectShard(context, relativeFiles);
+	}
+	if(extract){
+		return extractArchives(context, relativeFiles) ? 0 : -1;
+	}
+	if(!processArchives(context, relativeFiles, false)){
+		return -1;
+	}
+	if(settings.watch){
+		watchUpscaledFiles(context, relativeFiles);
+	}
+	return 0;
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+
+#include <unistd.h>
+
+// Accounting of the memory used by a run, to size machines and tune parallelism.
+// Allocations of the stb libraries go through trackedMalloc/trackedFree, and buffers owned by
+// the packer are declared with trackMemory. Each allocation is attributed to a category, and to
+// the job and archive set for the calling thread with a MemoryScope. The resident set size of
+// the process is also sampled in the background, for each phase of the run.
+
+enum MemoryCategory : uint32_t {
+	kMemoryDecode, // stb_image allocations, including decoded images.
+	kMemoryResize, // stb_image_resize temporary buffers.
+	kMemoryPixels, // upscaled images.
+	kMemoryEncode, // stb_image_write temporary buffers.
+	kMemoryOutput, // compressed results of jobs, before they are stored in their archive.
+	kMemoryBlobs, // archive data.
+	kMemoryCategoryCount,
+	kMemoryUntracked = kMemoryCategoryCount
+};
+
+const std::string memoryCategoryNames[kMemoryCategoryCount] = { "decode", "resize", "pixels", "encode", "output", "blobs" };
+
+struct MemoryCounter {
+	std::atomic<int64_t> current{0};
+	std::atomic<int64_t> peak{0};
+
+	void add(int64_t size){
+		const int64_t value = current += size;
+		int64_t previous = peak.load(std::memory_order_relaxed);
+		while(value > previous && !peak.compare_exchange_weak(previous, value, std::memory_order_relaxed)){}
+	}
+};
+
+struct MemoryPhase {
+	std::string name;
+	uint64_t samples{0};
+	uint64_t peakRss{0};
+	double averageRss{0.0};
+	int64_t peakTracked{0};
+	double averageTracked{0.0};
+};
+
+struct MemoryJobType {
+	uint64_t count{0};
+	int64_t peakSum{0};
+	int64_t peak{0};
+};
+
+struct MemoryTracker {
+	bool enabled{false};
+	MemoryCounter total;
+	MemoryCounter categories[kMemoryCategoryCount];
+
+	std::mutex mutex;
+	std::vector<MemoryPhase> phases;
+	std::map<std::string, MemoryJobType> jobTypes;
+	std::vector<std::pair<std::string, int64_t>> archives; // peak of each archive.
+	std::string largestJob;
+	int64_t largestJobPeak{0};
+
+	std::thread sampler;
+	std::condition_variable stopSampling;
+	bool stopping{false};
+
+	~MemoryTracker(){
+		stop();
+	}
+
+	// Sample the resident set size of the process every interval, until stopped.
+	void start(std::chrono::milliseconds interval){
+		enabled = true;
+		sampler = std::thread([this, interval](){
+			std::unique_lock<std::mutex> lock(mutex);
+			while(!stopping){
+				sampleLocked();
+				stopSampling.wait_for(lock, interval);
+			}
+		});
+	}
+
+	void stop(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		stopSampling.notify_all();
+		if(sampler.joinable()){
+			sampler.join();
+		}
+	}
+
+	static uint64_t residentSetSize(){
+		FILE* file = fopen("/proc/self/statm", "r");
+		if(!file){
+			return 0;
+		}
+		unsigned long long pages = 0;
+		unsigned long long residentPages = 0;
+		const int count = fscanf(file, "%llu %llu", &pages, &residentPages);
+		fclose(file);
+		return count == 2 ? uint64_t(residentPages) * uint64_t(sysconf(_SC_PAGESIZE)) : 0;
+	}
+
+	void sampleLocked(){
+		if(phases.empty()){
+			return;
+		}
+		MemoryPhase& phase = phases.back();
+		const uint64_t rss = residentSetSize();
+		const int64_t tracked = total.current;
+		++phase.samples;
+		phase.peakRss = std::max(phase.peakRss, rss);
+		phase.averageRss += (double(rss) - phase.averageRss) / double(phase.samples);
+		phase.peakTracked = std::max(phase.peakTracked, tracked);
+		phase.averageTracked += (double(tracked) - phase.averageTracked) / double(phase.samples);
+	}
+
+	// Start a new report, allocations still alive stay accounted.
+	void reset(){
+		std::lock_guard<std::mutex> lock(mutex);
+		phases.clear();
+		jobTypes.clear();
+		archives.clear();
+		largestJob.clear();
+		largestJobPeak = 0;
+		total.peak = total.current.load();
+		for(MemoryCounter& category : categories){
+			category.peak = category.current.load();
+		}
+	}
+
+	void beginPhase(const std::string& name){
+		if(!enabled){
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		sampleLocked();
+		phases.emplace_back();
+		phases.back().name = name;
+		sampleLocked();
+	}
+
+	void recordJob(const std::string& type, const std::string& label, int64_t peak){
+		std::lock_guard<std::mutex> lock(mutex);
+		MemoryJobType& jobType = jobTypes[type];
+		++jobType.count;
+		jobType.peakSum += peak;
+		jobType.peak = std::max(jobType.peak, peak);
+		if(peak > largestJobPeak){
+			largestJobPeak = peak;
+			largestJob = label;
+		}
+	}
+
+	void recordArchive(const std::string& name, int64_t peak){
+		std::lock_guard<std::mutex> lock(mutex);
+		archives.emplace_back(name, peak);
+	}
+};
+
+inline MemoryTracker& memoryTracker(){
+	static MemoryTracker tracker;
+	return tracker;
+}
+
+// Job and archive receiving the allocations of the calling thread.
+struct MemoryScope {
+	inline static thread_local MemoryCounter* currentJob = nullptr;
+	inline static thread_local MemoryCounter* currentArchive = nullptr;
+
+	MemoryCounter* previousJob;
+	MemoryCounter* previousArchive;
+
+	MemoryScope(MemoryCounter* job, MemoryCounter* archive) : previousJob(currentJob), previousArchive(currentArchive) {
+		currentJob = job;
+		currentArchive = archive;
+	}
+
+	~MemoryScope(){
+		currentJob = previousJob;
+		currentArchive = previousArchive;
+	}
+};
+
+inline void trackMemory(MemoryCategory category, int64_t size, MemoryCounter* job, MemoryCounter* archive){
+	MemoryTracker& tracker = memoryTracker();
+	if(!tracker.enabled || size == 0){
+		return;
+	}
+	tracker.total.add(size);
+	tracker.categories[category].add(size);
+	if(job){
+		job->add(size);
+	}
+	if(archive){
+		archive->add(size);
+	}
+}
+
+// Allocations keep their size and owners in front of the returned pointer, so that they are
+// released from the right counters, whichever thread frees them.
+struct alignas(16) AllocationHeader {
+	size_t size;
+	MemoryCounter* job;
+	MemoryCounter* archive;
+	MemoryCategory category;
+};
+
+inline void* trackedMalloc(size_t size, MemoryCategory category){
+	AllocationHeader* header = (AllocationHeader*)malloc(sizeof(AllocationHeader) + size);
+	if(!header){
+		return nullptr;
+	}
+	header->size = size;
+	header->job = MemoryScope::currentJob;
+	header->archive = MemoryScope::currentArchive;
+	header->category = memoryTracker().enabled ? category : kMemoryUntracked;
+	if(header->category != kMemoryUntracked){
+		trackMemory(category, int64_t(size), header->job, header->archive);
+	}
+	return header + 1;
+}
+
+inline void trackedFree(void* ptr){
+	if(!ptr){
+		return;
+	}
+	AllocationHeader* header = ((AllocationHeader*)ptr) - 1;
+	if(header->category != kMemoryUntracked){
+		trackMemory(header->category, -int64_t(header->size), header->job, header->archive);
+	}
+	free(header);
+}
+
+inline void* trackedRealloc(void* ptr, size_t size, MemoryCategory category){
+	if(!ptr){
+		return trackedMalloc(size, category);
+	}
+	AllocationHeader* header = ((AllocationHeader*)ptr) - 1;
+	const AllocationHeader previous = *header;
+	AllocationHeader* newHeader = (AllocationHeader*)realloc(header, sizeof(AllocationHeader) + size);
+	if(!newHeader){
+		return nullptr;
+	}
+	newHeader->size = size;
+	if(previous.category != kMemoryUntracked){
+		trackMemory(previous.category, int64_t(size) - int64_t(previous.size), previous.job, previous.archive);
+	}
+	return newHeader + 1;
+}
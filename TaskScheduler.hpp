@@ -0,0 +1,238 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <memory>
+#include <random>
+
+// Work-stealing task scheduler shared by all levels of parallelism.
+// Each worker pushes the tasks it spawns to its own deque and runs them last-in first-out,
+// idle workers steal the oldest tasks of other workers. Tasks spawned from outside the
+// workers go to a shared queue. Waiting on a group runs the tasks of that group found at the ends
+// of the queues instead of blocking, so tasks can spawn and wait for subtasks at any depth, while
+// unrelated tasks never run nested in a wait and the stack only grows with the nesting of groups.
+// As a group waits for the subtasks it spawned, they are on top of the waiting worker's own queue.
+// Sleeping threads are counted, so that spawning only notifies when someone can take the task.
+
+struct TaskGroup {
+	std::atomic<size_t> pending{0};
+	std::atomic<size_t> spawned{0}; // tells a thread waiting on the group that new tasks were queued.
+	std::atomic<unsigned int> sleepers{0}; // threads sleeping in wait on the group.
+};
+
+struct TaskScheduler {
+
+	struct Task {
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+
+	struct WorkerQueue {
+		std::deque<Task> tasks;
+		std::mutex mutex;
+	};
+
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::deque<Task> injected;
+	std::mutex injectedMutex;
+	std::vector<std::thread> threads;
+
+	std::mutex sleepMutex;
+	std::condition_variable workAvailable; // for idle workers.
+	std::condition_variable groupChanged; // for threads waiting on a group.
+	std::atomic<size_t> queuedCount{0};
+	std::atomic<unsigned int> idleWorkers{0};
+	std::atomic<unsigned int> waitingThreads{0};
+	bool stopping{false};
+
+	explicit TaskScheduler(unsigned int threadCount){
+		threadCount = std::max(threadCount, 1u);
+		for(unsigned int i = 0; i < threadCount; ++i){
+			queues.emplace_back(new WorkerQueue());
+		}
+		for(unsigned int i = 0; i < threadCount; ++i){
+			threads.emplace_back([this, i](){ work(i); });
+		}
+	}
+
+	~TaskScheduler(){
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		workAvailable.notify_all();
+		groupChanged.notify_all();
+		for(std::thread& thread : threads){
+			thread.join();
+		}
+	}
+
+	unsigned int workerCount() const {
+		return (unsigned int)threads.size();
+	}
+
+	// Index of the worker running on the calling thread, -1 for other threads.
+	int& currentWorker(){
+		thread_local int index = -1;
+		thread_local const TaskScheduler* owner = nullptr;
+		if(owner != this){
+			owner = this;
+			index = -1;
+		}
+		return index;
+	}
+
+	void spawn(TaskGroup& group, std::function<void()> function){
+		++group.pending;
+		++group.spawned;
+		++queuedCount;
+		const int worker = currentWorker();
+		if(worker >= 0){
+			std::lock_guard<std::mutex> lock(queues[worker]->mutex);
+			queues[worker]->tasks.push_back({ std::move(function), &group });
+		} else {
+			std::lock_guard<std::mutex> lock(injectedMutex);
+			injected.push_back({ std::move(function), &group });
+		}
+		// One idle worker is enough to take the task, threads waiting on the group may also run it.
+		// Sleepers are counted under the lock before testing their condition, so none is missed.
+		const bool idle = idleWorkers != 0;
+		const bool waiting = group.sleepers != 0;
+		if(idle || waiting){
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			if(idle){
+				workAvailable.notify_one();
+			}
+			if(waiting){
+				groupChanged.notify_all();
+			}
+		}
+	}
+
+	// Run tasks of the group until it is complete.
+	void wait(TaskGroup& group){
+		while(group.pending != 0){
+			const size_t spawned = group.spawned;
+			if(runOne(&group)){
+				continue;
+			}
+			// The remaining tasks of the group are running or will be taken by other workers.
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			++group.sleepers;
+			++waitingThreads;
+			groupChanged.wait(lock, [this, &group, spawned](){ return group.pending == 0 || group.spawned != spawned || stopping; });
+			--waitingThreads;
+			--group.sleepers;
+		}
+	}
+
+	// Split [begin, end) in ranges of at most grain elements, processed as tasks.
+	void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& function){
+		grain = std::max(grain, size_t(1));
+		if(end <= begin){
+			return;
+		}
+		if(end - begin <= grain){
+			function(begin, end);
+			return;
+		}
+		TaskGroup group;
+		for(size_t first = begin + grain; first < end; first += grain){
+			const size_t last = std::min(first + grain, end);
+			spawn(group, [&function, first, last](){ function(first, last); });
+		}
+		// Process the first range on this thread.
+		function(begin, std::min(begin + grain, end));
+		wait(group);
+	}
+
+	// Take the task at the given end if it is of the given group, or of any group if null.
+	// Tasks deeper in the queue are left to other threads, so that taking one is constant time.
+	static bool takeTask(std::deque<Task>& tasks, const TaskGroup* group, bool fromBack, Task& task){
+		if(tasks.empty()){
+			return false;
+		}
+		Task& end = fromBack ? tasks.back() : tasks.front();
+		if(group != nullptr && end.group != group){
+			return false;
+		}
+		task = std::move(end);
+		if(fromBack){
+			tasks.pop_back();
+		} else {
+			tasks.pop_front();
+		}
+		return true;
+	}
+
+	bool popTask(Task& task, const TaskGroup* group){
+		const int worker = currentWorker();
+		// Own tasks, most recent first.
+		if(worker >= 0){
+			WorkerQueue& queue = *queues[worker];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if(takeTask(queue.tasks, group, true, task)){
+				return true;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(injectedMutex);
+			if(takeTask(injected, group, false, task)){
+				return true;
+			}
+		}
+		// Steal the oldest task of another worker, starting from a random one.
+		thread_local std::minstd_rand random(std::hash<std::thread::id>()(std::this_thread::get_id()));
+		const size_t queueCount = queues.size();
+		const size_t start = random() % queueCount;
+		for(size_t i = 0; i < queueCount; ++i){
+			const size_t victim = (start + i) % queueCount;
+			if(int(victim) == worker){
+				continue;
+			}
+			WorkerQueue& queue = *queues[victim];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if(takeTask(queue.tasks, group, false, task)){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Run a task of the given group, or of any group if null.
+	bool runOne(const TaskGroup* group = nullptr){
+		Task task;
+		if(!popTask(task, group)){
+			return false;
+		}
+		--queuedCount;
+		task.function();
+		// The group may be destroyed as soon as it is complete, only the scheduler is accessed afterwards.
+		if(--task.group->pending == 0 && waitingThreads != 0){
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			groupChanged.notify_all();
+		}
+		return true;
+	}
+
+	void work(unsigned int index){
+		currentWorker() = int(index);
+		while(true){
+			if(runOne()){
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			++idleWorkers;
+			workAvailable.wait(lock, [this](){ return stopping || queuedCount != 0; });
+			--idleWorkers;
+			if(stopping){
+				return;
+			}
+		}
+	}
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+// Timeline of a run in the Chrome trace event format, to open in Perfetto or chrome://tracing.
+// Each thread appends spans to its own buffer without locking, buffers are only merged when the
+// trace is written, once no task is running. Strings are either static or registered once as labels,
+// so recording a span is a clock read and a push. When disabled, spans only test a flag.
+
+struct TraceEvent {
+	const char* name; // static.
+	const char* category; // static.
+	uint64_t start; // in nanoseconds since the creation of the trace.
+	uint64_t duration;
+	uint32_t label; // registered string, or kNoLabel.
+	uint32_t id; // for asynchronous spans, spanning multiple threads.
+	bool async;
+};
+
+struct Trace {
+	static const uint32_t kNoLabel = 0xFFFFFFFF;
+
+	struct ThreadBuffer {
+		std::vector<TraceEvent> events;
+		uint32_t thread;
+	};
+
+	bool enabled{false};
+	std::chrono::steady_clock::time_point origin{std::chrono::steady_clock::now()};
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+	std::deque<std::string> labels;
+	std::atomic<uint32_t> nextId{0};
+
+	uint64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	// Buffer of the calling thread, created on first use.
+	ThreadBuffer& currentBuffer(){
+		thread_local ThreadBuffer* buffer = nullptr;
+		thread_local const Trace* owner = nullptr;
+		if(owner != this){
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers.emplace_back(new ThreadBuffer());
+			buffers.back()->thread = uint32_t(buffers.size());
+			buffers.back()->events.reserve(1024);
+			buffer = buffers.back().get();
+			owner = this;
+		}
+		return *buffer;
+	}
+
+	// Identifier of an asynchronous span, unique until the trace is cleared.
+	uint32_t newId(){
+		return nextId++;
+	}
+
+	uint32_t registerLabel(const std::string& label){
+		if(!enabled){
+			return kNoLabel;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		labels.push_back(label);
+		return uint32_t(labels.size() - 1);
+	}
+
+	void record(const char* name, const char* category, uint64_t start, uint64_t end, uint32_t label = kNoLabel){
+		currentBuffer().events.push_back({ name, category, start, end - start, label, 0, false });
+	}
+
+	// Span not tied to a thread, such as the time a job spends in a queue.
+	void recordAsync(const char* name, const char* category, uint32_t id, uint64_t start, uint64_t end, uint32_t label = kNoLabel){
+		currentBuffer().events.push_back({ name, category, start, end - start, label, id, true });
+	}
+
+	static void writeString(FILE* file, const char* str){
+		fputc('"', file);
+		for(const char* c = str; *c != '\0'; ++c){
+			if(*c == '"' || *c == '\\'){
+				fputc('\\', file);
+			}
+			if((unsigned char)(*c) >= 0x20){
+				fputc(*c, file);
+			}
+		}
+		fputc('"', file);
+	}
+
+	void writeEvent(FILE* file, const TraceEvent& event, uint32_t thread, const char* phase, double timestamp, bool& first) const {
+		fputs(first ? "\n" : ",\n", file);
+		first = false;
+		fputs("{\"name\":", file);
+		writeString(file, event.name);
+		fputs(",\"cat\":", file);
+		writeString(file, event.category);
+		fprintf(file, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u", phase, timestamp, thread);
+		if(phase[0] == 'X'){
+			fprintf(file, ",\"dur\":%.3f", double(event.duration) / 1000.0);
+		}
+		if(event.async){
+			fprintf(file, ",\"id\":%u", event.id);
+		}
+		if(event.label != kNoLabel){
+			fputs(",\"args\":{\"item\":", file);
+			writeString(file, labels[event.label].c_str());
+			fputc('}', file);
+		}
+		fputc('}', file);
+	}
+
+	// Must be called while no other thread records events.
+	bool write(const std::string& path) const {
+		FILE* file = fopen(path.c_str(), "wb");
+		if(!file){
+			return false;
+		}
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+		bool first = true;
+		for(const std::unique_ptr<ThreadBuffer>& buffer : buffers){
+			fputs(first ? "\n" : ",\n", file);
+			first = false;
+			fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", buffer->thread, buffer->thread);
+			for(const TraceEvent& event : buffer->events){
+				const double start = double(event.start) / 1000.0;
+				if(event.async){
+					writeEvent(file, event, buffer->thread, "b", start, first);
+					writeEvent(file, event, buffer->thread, "e", start + double(event.duration) / 1000.0, first);
+				} else {
+					writeEvent(file, event, buffer->thread, "X", start, first);
+				}
+			}
+		}
+		fputs("\n]}\n", file);
+		return fclose(file) == 0;
+	}
+
+	// Drop recorded events and labels, so that the next write only contains the following runs.
+	// Buffers are kept as threads refer to them. Must be called while no other thread records events.
+	void clear(){
+		std::lock_guard<std::mutex> lock(mutex);
+		for(const std::unique_ptr<ThreadBuffer>& buffer : buffers){
+			buffer->events.clear();
+		}
+		labels.clear();
+		nextId = 0;
+	}
+};
+
+// Record the lifetime of the span on the calling thread.
+struct TraceSpan {
+	Trace* trace;
+	const char* name;
+	const char* category;
+	uint32_t label;
+	uint64_t start;
+
+	TraceSpan(Trace& traceRef, const char* spanName, const char* spanCategory, uint32_t spanLabel = Trace::kNoLabel) :
+		trace(traceRef.enabled ? &traceRef : nullptr), name(spanName), category(spanCategory), label(spanLabel), start(trace ? trace->now() : 0) {}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	~TraceSpan(){
+		if(trace){
+			trace->record(name, category, start, trace->now(), label);
+		}
+	}
+};